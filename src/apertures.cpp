@@ -22,6 +22,18 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <vector>
 #include <list>
 #include <map>
+#include <algorithm>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -58,20 +70,189 @@ const char * Aperture::rs274x_name()
 }
 
 
+//
+// Append the postfix code of the expression tree at node, folding operations whose operands are both constants.
+// The divisor of a division is placed first so that it is tested for zero before the dividend is evaluated.
+//
+void ParameterProgram::emit(const NodeT *node, int &depth, int &maxDepth)
+{
+	Instruction in;
+	in.varID = -1;
+	in.value = 0;
+	switch (node->type)
+	{
+	case NodeT::CONSTANT:
+		in.op = PUSH_CONSTANT;
+		in.value = node->arg1.value;
+		code.push_back(in);
+		if (++depth > maxDepth) maxDepth = depth;
+		return;
+	case NodeT::VAR:
+		in.op = PUSH_VARIABLE;
+		in.varID = node->arg1.varID;
+		code.push_back(in);
+		if (in.varID > highestVariable.back()) highestVariable.back() = in.varID;
+		if (++depth > maxDepth) maxDepth = depth;
+		return;
+	case NodeT::OPNEG:
+		emit(node->arg1.node, depth, maxDepth);
+		if (code.back().op == PUSH_CONSTANT)
+			code.back().value = -code.back().value;
+		else
+		{
+			in.op = OPNEG;
+			code.push_back(in);
+		}
+		return;
+	default:
+		break;
+	}
+
+	const NodeT *first = node->arg1.node;
+	const NodeT *second = node->arg2.node;
+	if (node->type == NodeT::OPDIV)
+		swap(first, second);
+	size_t firstAt = code.size();
+	emit(first, depth, maxDepth);
+	size_t secondAt = code.size();
+	emit(second, depth, maxDepth);
+	depth--;
+
+	double a = code[firstAt].value;
+	double b = code[secondAt].value;
+	bool isFoldable = secondAt == firstAt + 1 && code.size() == secondAt + 1
+					&& code[firstAt].op == PUSH_CONSTANT && code[secondAt].op == PUSH_CONSTANT;
+	switch (node->type)
+	{
+	case NodeT::OPADD:	in.op = OPADD;	in.value = a + b;	break;
+	case NodeT::OPSUB:	in.op = OPSUB;	in.value = a - b;	break;
+	case NodeT::OPMUL:	in.op = OPMUL;	in.value = a * b;	break;
+	default:
+		in.op = OPDIV;
+		isFoldable = isFoldable && a != 0;		// leave a division by zero to be reported when evaluated
+		if (isFoldable) in.value = b / a;
+		break;
+	}
+	if (isFoldable)
+	{
+		code.resize(firstAt + 1);
+		code.back().value = in.value;
+	}
+	else
+		code.push_back(in);
+}
+
+
+void ParameterProgram::compile(const vector<NodeT *> &expressions, const vector<double> &variables)
+{
+	code.clear();
+	start.assign(1, 0);
+	highestVariable.clear();
+	this->variables = &variables;
+	int maxDepth = 0;
+	for (size_t i=0; i < expressions.size(); i++)
+	{
+		int depth = 0;
+		highestVariable.push_back(-1);
+		emit(expressions[i], depth, maxDepth);
+		start.push_back(code.size());
+	}
+	stack.resize(maxDepth);
+}
+
+
+void ParameterProgram::throwUnassigned(int index) const
+{
+	for (int i = start[index]; i < start[index+1]; i++)
+		if (code[i].op == PUSH_VARIABLE && code[i].varID >= (int)variables->size())
+		{
+			ostringstream oss;
+			oss<<"variable $"<<(code[i].varID+1)<<" has not been assigned";
+			throw oss.str();
+		}
+}
+
+
+double ParameterProgram::evaluate(int index) const
+{
+	const Instruction *in = &code[start[index]];
+	const Instruction *end = in + (start[index+1] - start[index]);
+	if (end - in == 1 && in->op == PUSH_CONSTANT)
+		return in->value;
+	if (highestVariable[index] >= (int)variables->size())
+		throwUnassigned(index);
+
+	double *top = &stack[0] - 1;
+	for (; in != end; in++)
+	{
+		switch (in->op)
+		{
+		case PUSH_CONSTANT:	*++top = in->value;					break;
+		case PUSH_VARIABLE:	*++top = (*variables)[in->varID];	break;
+		case OPNEG:			*top = -*top;						break;
+		case OPADD:			top--;	top[0] += top[1];			break;
+		case OPSUB:			top--;	top[0] -= top[1];			break;
+		case OPMUL:			top--;	top[0] *= top[1];			break;
+		case OPDIV:
+			top--;
+			if (top[0] == 0) throw string("division by zero");
+			top[0] = top[1] / top[0];
+			break;
+		}
+	}
+	return *top;
+}
+
+
+static void appendBytes(string &key, const void *p, size_t n)
+{
+	key.append( static_cast<const char *>(p), n);
+}
+
+
+// FNV-1a hash of n bytes, continuing from hash
+static unsigned long long fnv1a(const void *p, size_t n, unsigned long long hash = 14695981039346656037ULL)
+{
+	const unsigned char *bytes = static_cast<const unsigned char *>(p);
+	for (size_t i=0; i < n; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+
+void ParameterProgram::appendKey(string &key) const
+{
+	int count = size();
+	appendBytes(key, &count, sizeof(count));
+	for (size_t i=0; i < code.size(); i++)
+	{
+		appendBytes(key, &code[i].op, sizeof(code[i].op));
+		if (code[i].op == PUSH_CONSTANT)
+			appendBytes(key, &code[i].value, sizeof(code[i].value));
+		else if (code[i].op == PUSH_VARIABLE)
+			appendBytes(key, &code[i].varID, sizeof(code[i].varID));
+	}
+	appendBytes(key, &start[0], start.size() * sizeof(start[0]));
+}
+
+
 //
 // Safely gets value from Aperture::modifier at element number idx
 //
 double Aperture::getParameter(int idx)
 {
 	ostringstream oss;
-	if (idx >= parameter.size())
+	if (size_t(idx) >= parameters.size())
 	{
 		oss	<<"modifier expected at position "<<(idx+1);
 		throw oss.str();
 	}
 	try
 	{
-		return parameter[idx]->evaluate();
+		return parameters.evaluate(idx);
 	}
 	catch (string msg)
 	{
@@ -85,7 +266,7 @@ double Aperture::getParameter(int idx)
 //------------------------------------------------------------
 // function for adding a new element to the link list of
 // Aperture objects.
-void Aperture::render(const double dots_per_unit, const double grow_size, int ADmodifierCount)
+void Aperture::render(const double dots_per_unit, const double grow_size, int ADmodifierCount, Arena<VertexData> &vertexArena)
 {
 	double rotation = 0;
 	double standardHoleX = 0;
@@ -103,7 +284,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 	case SPECIAL_CIRCLE :
 	{
 		double  ysize, xsize, x_center=0, y_center=0;
-		polygons.push_back(Polygon());		// Create instance of empty polygon
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 
 		if (primitive == STANDARD_CIRCLE)
 		{
@@ -120,7 +301,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		}
 		else if (primitive == SPECIAL_CIRCLE)
 		{
-			if (getParameter(0) == 1) {	polygons.back().polarity = CLEAR; }
+			if (getParameter(0) == 0) {	polygons.back().polarity = CLEAR; }
 			ysize = xsize 	= getParameter(1) * dots_per_unit;
 			x_center 		= getParameter(2) * dots_per_unit;
 			y_center 		= getParameter(3) * dots_per_unit;
@@ -158,7 +339,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 	case STANDARD_RECTANGLE :
 	{
 		double y_size, x_size;
-		polygons.push_back(Polygon());		// Create instance of empty polygon
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 
 		y_size = x_size = getParameter(0) * dots_per_unit - 0.5  + grow_size;
 		// (RS274X  botch) If only 1 modifier given then assume square.
@@ -192,7 +373,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		int nsides;
 		double x_centre = 0;
 		double y_centre = 0;
-		polygons.push_back(Polygon());		// Create instance of empty polygon
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 
 		if ( primitive == STANDARD_POLYGON)
 		{
@@ -205,7 +386,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		}
 		else if ( primitive == SPECIAL_POLYGON)
 		{
-			if (getParameter(0) == 1) {	polygons.back().polarity = CLEAR; }
+			if (getParameter(0) == 0) {	polygons.back().polarity = CLEAR; }
 			nsides 		= int(getParameter(1));
 			x_centre 	= getParameter(2) * dots_per_unit;
 			y_centre 	= getParameter(3) * dots_per_unit;
@@ -250,7 +431,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		double theta = rotation;
 		for (int i=0; i < 4; i++)
 		{
-			polygons.push_back(Polygon());		// Create instance of empty polygon
+			polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 		    polygons.back().vdata->addArc( theta + argout, theta+(M_PI/2 - argout), outside_radius, x_centre, y_centre, false);
 		    polygons.back().vdata->addArc( theta + ( M_PI/2 - argin), theta + argin, inside_radius, x_centre, y_centre, true);
 		    theta += M_PI/2;
@@ -278,9 +459,9 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 
 		double rectangle_length, rectangle_height, theta;
 		Point start, end, centre;
-		polygons.push_back(Polygon());		// Create instance of empty polygon
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 
-		if (getParameter(0) == 1) {	polygons.back().polarity = CLEAR; }
+		if (getParameter(0) == 0) {	polygons.back().polarity = CLEAR; }
 
 		switch(primitive)
 		{
@@ -336,16 +517,16 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 	// ******************************************************************************
 	case SPECIAL_OUTLINE :
 	{
-		polygons.push_back(Polygon());		// Create instance of empty polygon
-		if (getParameter(0) == 1) {	polygons.back().polarity = CLEAR; }
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
+		if (getParameter(0) == 0) {	polygons.back().polarity = CLEAR; }
 
 		int num_points		= int ( getParameter(1) );
 
 		// rotation radians (+ = counterclockwise, - = clockwise)
 		// last parameter is always specifies rotation regardless of number of surplus vertices.
-		rotation = parameter.back()->evaluate() * M_PI / 180.0;
+		rotation = getParameter(parameters.size() - 1) * M_PI / 180.0;
 
-		if (num_points*2 + 3 > parameter.size() )
+		if (size_t(num_points*2 + 3) > parameters.size() )
 			throw string("specified number of points exceeds number of vertices listed");
 
 		for (int i=0; i < num_points; i++ )
@@ -380,16 +561,16 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		{
 		    if (diameter < 1) break;
 		    UPLIMIT(thickenss, diameter/2);
-			polygons.push_back(Polygon());		// Create instance of empty polygon
+			polygons.push_back(Polygon( new (vertexArena) VertexData ));		// Create instance of empty polygon
 		    polygons.back().vdata->addArc( 0, 2*M_PI, diameter/2, x_centre, y_centre, false);
 		    polygons.back().vdata->addArc( 2*M_PI, 0, diameter/2 - thickenss, x_centre, y_centre, true);
 		    polygons.back().vdata->rotate(rotation);
 		    diameter -= 2*(thickenss + gap);
 		}
-		polygons.push_back(Polygon());
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));
 	    polygons.back().vdata->addRectangle(hair_thickness, hair_length, x_centre, y_centre);
 	    polygons.back().vdata->rotate(rotation);
-		polygons.push_back(Polygon());
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));
 	    polygons.back().vdata->addRectangle(hair_length, hair_thickness, x_centre, y_centre);
 	    polygons.back().vdata->rotate(rotation);
 		break;
@@ -401,7 +582,7 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 	// then add a hole by adding one final clear circle or rectangle polygon to end of the list.
 	if ( standardHoleX > 0.5 )
 	{
-		polygons.push_back(Polygon());
+		polygons.push_back(Polygon( new (vertexArena) VertexData ));
 		polygons.back().polarity = CLEAR;
 		if ( standardHoleY > 0.5 )
 			polygons.back().vdata->addRectangle(standardHoleX, standardHoleY);
@@ -409,3 +590,351 @@ void Aperture::render(const double dots_per_unit, const double grow_size, int AD
 		    polygons.back().vdata->addArc( 0, 2*M_PI, standardHoleX / 2, 0, 0, false);
 	}
 }
+
+
+
+//------------------------------------------------------------
+//				Aperture cache
+//------------------------------------------------------------
+
+string ApertureCache::key(const vector<Aperture> &primitives, const vector<double> &modifiers,
+							double dotsPerUnit, double growSize, const double scale[2])
+{
+	string key;
+	for (size_t k=0; k < primitives.size(); k++)
+	{
+		int primitive = primitives[k].primitive;
+		appendBytes(key, &primitive, sizeof(primitive));
+		primitives[k].parameters.appendKey(key);
+	}
+	int count = modifiers.size();
+	appendBytes(key, &count, sizeof(count));
+	if (count > 0)
+		appendBytes(key, &modifiers[0], count * sizeof(modifiers[0]));
+	appendBytes(key, &dotsPerUnit, sizeof(dotsPerUnit));
+	appendBytes(key, &growSize, sizeof(growSize));
+	appendBytes(key, scale, 2 * sizeof(scale[0]));
+	appendBytes(key, &VertexData::arcTolerance, sizeof(VertexData::arcTolerance));
+	return key;
+}
+
+
+vector<Aperture> * ApertureCache::find(const string &key)
+{
+	map< string, vector<Aperture> >::iterator it = apertures.find(key);
+	if (it == apertures.end())
+	{
+		missCount++;
+		return 0;
+	}
+	hitCount++;
+	return &it->second;
+}
+
+
+vector<Aperture> & ApertureCache::insert(const string &key, const vector<Aperture> &rendered)
+{
+	return apertures[key] = rendered;
+}
+
+
+//
+// Vertex data of a cached aperture transformed by the image transform and initialised, made on first use.
+//
+VertexData * ApertureCache::scanTable(VertexData *vd, const Transform &image)
+{
+	MutexLock lock(mutex);
+	vector<double> m(6);
+	m[0] = image.xx;	m[1] = image.xy;	m[2] = image.dx;
+	m[3] = image.yx;	m[4] = image.yy;	m[5] = image.dy;
+	VertexData *&table = scanTables[ make_pair(vd, m) ];
+	if (table != 0)
+	{
+		scanTableHitCount++;
+		return table;
+	}
+	scanTableMissCount++;
+
+	// The file key holds everything the scan table is made from
+	string key, path;
+	if (!directory.empty() && !vd->empty())
+	{
+		int version = FILE_VERSION;
+		int shape = vd->shape;
+		int isClockwise = vd->isClockwise;
+		int vertexCount = vd->vertices.size();
+		int penCount = vd->pen.size();
+		appendBytes(key, &version, sizeof(version));
+		appendBytes(key, &VertexData::arcTolerance, sizeof(VertexData::arcTolerance));
+		appendBytes(key, &m[0], m.size() * sizeof(m[0]));
+		appendBytes(key, &shape, sizeof(shape));
+		appendBytes(key, &isClockwise, sizeof(isClockwise));
+		appendBytes(key, &vd->radius, sizeof(vd->radius));
+		appendBytes(key, &vd->sweep, sizeof(vd->sweep));
+		appendBytes(key, &vertexCount, sizeof(vertexCount));
+		if (vertexCount > 0)
+			appendBytes(key, &vd->vertices[0], vertexCount * sizeof(Point));
+		appendBytes(key, &penCount, sizeof(penCount));
+		if (penCount > 0)
+			appendBytes(key, &vd->pen[0], penCount * sizeof(Point));
+
+		char name[32];
+		sprintf(name, "/%016llx.g2s", fnv1a(key.data(), key.size()));
+		path = directory + name;
+
+		table = loadScanTable(key, path);
+		if (table != 0)
+		{
+			fileHitCount++;
+			return table;
+		}
+		fileMissCount++;
+	}
+
+	table = new (vertexArena) VertexData(*vd);
+	if (!image.isIdentity())
+		table->transform(image);
+	table->initialise();
+	if (!path.empty())
+		saveScanTable(key, path, table);
+	return table;
+}
+
+
+//
+// Layout of a scan table file. The header is followed by the key, padded to 8 bytes, the vertices and pen
+// as pairs of doubles, then the x intersections and the counts of intersections on each line.
+//
+struct ScanTableHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int keyBytes;
+	unsigned int vertexCount;
+	unsigned int penCount;
+	unsigned int intersectCount;
+	unsigned int lineCount;
+	int shape;
+	int isClockwise;
+	int pixelHeigth;
+	int pixelWidth;
+	double radius;
+	double sweep;
+	double minx, miny, maxx, maxy;
+	double lastVertex[2];
+	unsigned long long checksum;		// FNV-1a of the file, without this field
+};
+
+static const char scanTableMagic[8] = "G2TSCAN";
+
+static unsigned long long scanTableChecksum(const ScanTableHeader &h, const void *data, size_t size)
+{
+	return fnv1a(data, size, fnv1a(&h, offsetof(ScanTableHeader, checksum)));
+}
+
+static size_t scanTableFileSize(const ScanTableHeader &h)
+{
+	return sizeof(h) + (h.keyBytes + 7) / 8 * 8 + (h.vertexCount + h.penCount) * sizeof(Point)
+			+ (h.intersectCount + h.lineCount) * sizeof(int);
+}
+
+
+bool ApertureCache::setDirectory(const string &path, unsigned long long maxBytes)
+{
+	if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+		return false;
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+		return false;
+	directory = path;
+	directoryLimit = maxBytes;
+	evict();
+	return true;
+}
+
+
+//
+// Whether the scan table of a file is one the rasterizer can step through: a count for each line, adding up to
+// the intersections, which lie within the pixel width.
+//
+static bool isScanTableValid(const ScanTableHeader &h, const int *intersects, const int *lineCounts)
+{
+	if (h.pixelHeigth < 0 || h.lineCount != (unsigned int)h.pixelHeigth + 1 || h.pixelWidth < 0
+		|| !(fabs(h.minx) < INT_MAX/2) || h.shape < VertexData::OUTLINE || h.shape > VertexData::STROKE)
+		return false;
+	unsigned long long count = 0;
+	for (size_t i=0; i < h.lineCount; i++)
+	{
+		if (lineCounts[i] < 0)
+			return false;
+		count += lineCounts[i];
+	}
+	if (count != h.intersectCount)
+		return false;
+	const int x1 = h.minx < 0 ? int(h.minx - 0.5) : int(h.minx + 0.5);		// the pixel of minx, as VertexData rounds it
+	for (size_t i=0; i < h.intersectCount; i++)
+		if (intersects[i] < x1 || intersects[i] > x1 + h.pixelWidth + 1)
+			return false;
+	return true;
+}
+
+
+//
+// Read the scan table of the file at path, or return 0 when it does not exist, was made from another key or is
+// damaged, so that it is made and written again. Besides the checksum, the scan table is checked before the
+// rasterizer steps through it.
+//
+VertexData * ApertureCache::loadScanTable(const string &key, const string &path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ScanTableHeader))
+	{
+		close(fd);
+		return 0;
+	}
+	size_t size = st.st_size;
+	void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	const ScanTableHeader &h = *static_cast<const ScanTableHeader *>(map);
+	const char *p = static_cast<const char *>(map) + sizeof(h);
+	if (memcmp(h.magic, scanTableMagic, sizeof(h.magic)) != 0 || h.version != FILE_VERSION
+		|| h.keyBytes != key.size() || scanTableFileSize(h) != size || memcmp(p, key.data(), key.size()) != 0
+		|| scanTableChecksum(h, p, size - sizeof(h)) != h.checksum)
+	{
+		munmap(map, size);
+		return 0;
+	}
+	p += (h.keyBytes + 7) / 8 * 8;
+	const Point *points = reinterpret_cast<const Point *>(p);
+	const int *ints = reinterpret_cast<const int *>(points + h.vertexCount + h.penCount);
+	if (!isScanTableValid(h, ints, ints + h.intersectCount))
+	{
+		munmap(map, size);
+		return 0;
+	}
+
+	VertexData *vd = new (vertexArena) VertexData;
+	vd->shape = VertexData::Shape_t(h.shape);
+	vd->isClockwise = h.isClockwise;
+	vd->radius = h.radius;
+	vd->sweep = h.sweep;
+	vd->minx = h.minx;
+	vd->miny = h.miny;
+	vd->maxx = h.maxx;
+	vd->maxy = h.maxy;
+	vd->pixelHeigth = h.pixelHeigth;
+	vd->pixelWidth = h.pixelWidth;
+	vd->lastVertex = Point(h.lastVertex[0], h.lastVertex[1]);
+	vd->vertices.assign(points, points + h.vertexCount);
+	vd->pen.assign(points + h.vertexCount, points + h.vertexCount + h.penCount);
+	vd->gxIntersects.assign(ints, ints + h.intersectCount);
+	vd->linesInCounts.assign(ints + h.intersectCount, ints + h.intersectCount + h.lineCount);
+	munmap(map, size);
+
+	utime(path.c_str(), 0);		// mark as recently used
+	return vd;
+}
+
+
+//
+// Write the scan table to a temporary file renamed to path, so other processes never read a partial file.
+// Failures are ignored; the scan table is made again next time.
+//
+void ApertureCache::saveScanTable(const string &key, const string &path, const VertexData *vd)
+{
+	ScanTableHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, scanTableMagic, sizeof(h.magic));
+	h.version = FILE_VERSION;
+	h.keyBytes = key.size();
+	h.vertexCount = vd->vertices.size();
+	h.penCount = vd->pen.size();
+	h.intersectCount = vd->gxIntersects.size();
+	h.lineCount = vd->linesInCounts.size();
+	h.shape = vd->shape;
+	h.isClockwise = vd->isClockwise;
+	h.pixelHeigth = vd->pixelHeigth;
+	h.pixelWidth = vd->pixelWidth;
+	h.radius = vd->radius;
+	h.sweep = vd->sweep;
+	h.minx = vd->minx;
+	h.miny = vd->miny;
+	h.maxx = vd->maxx;
+	h.maxy = vd->maxy;
+	h.lastVertex[0] = vd->lastVertex.x;
+	h.lastVertex[1] = vd->lastVertex.y;
+
+	string data;
+	data.reserve(scanTableFileSize(h));
+	appendBytes(data, &h, sizeof(h));
+	data += key;
+	data.append((h.keyBytes + 7) / 8 * 8 - h.keyBytes, '\0');
+	if (h.vertexCount > 0)		appendBytes(data, &vd->vertices[0], h.vertexCount * sizeof(Point));
+	if (h.penCount > 0)			appendBytes(data, &vd->pen[0], h.penCount * sizeof(Point));
+	if (h.intersectCount > 0)	appendBytes(data, &vd->gxIntersects[0], h.intersectCount * sizeof(int));
+	if (h.lineCount > 0)		appendBytes(data, &vd->linesInCounts[0], h.lineCount * sizeof(int));
+	h.checksum = scanTableChecksum(h, data.data() + sizeof(h), data.size() - sizeof(h));
+	data.replace(0, sizeof(h), reinterpret_cast<const char *>(&h), sizeof(h));
+
+	char suffix[32];
+	sprintf(suffix, ".%d.tmp", int(getpid()));
+	string temporary = path + suffix;
+	FILE *fp = fopen(temporary.c_str(), "wb");
+	if (fp == 0)
+		return;
+	bool isWritten = fwrite(data.data(), 1, data.size(), fp) == data.size();
+	if (fclose(fp) != 0 || !isWritten || rename(temporary.c_str(), path.c_str()) != 0)
+	{
+		unlink(temporary.c_str());
+		return;
+	}
+
+	directoryBytes += data.size();
+	if (directoryBytes > directoryLimit)
+		evict();
+}
+
+
+//
+// Count the bytes of the scan table files, and when over the limit remove the least recently used files
+// until they take three quarters of it, so that eviction is not needed again on every new file.
+//
+void ApertureCache::evict()
+{
+	DIR *dir = opendir(directory.c_str());
+	if (dir == 0)
+		return;
+	vector< pair<time_t, pair<string, unsigned long long> > > files;
+	directoryBytes = 0;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != 0)
+	{
+		string name = entry->d_name;
+		if (name.size() < 4 || name.compare(name.size() - 4, 4, ".g2s") != 0)
+			continue;
+		string path = directory + "/" + name;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		files.push_back( make_pair(st.st_mtime, make_pair(path, (unsigned long long)st.st_size)) );
+		directoryBytes += st.st_size;
+	}
+	closedir(dir);
+
+	if (directoryBytes <= directoryLimit)
+		return;
+	sort(files.begin(), files.end());
+	for (size_t i=0; i < files.size() && directoryBytes > directoryLimit / 4 * 3; i++)
+	{
+		if (unlink(files[i].second.first.c_str()) != 0)
+			continue;
+		directoryBytes -= files[i].second.second;
+		fileEvictCount++;
+	}
+}
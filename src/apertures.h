@@ -41,7 +41,6 @@ public:
 	} arg1;
 
 	union {
-		std::vector<double> * variables;
 		struct NodeT *node;
 	} arg2;
 
@@ -63,35 +62,42 @@ public:
 			break;
 		case VAR:
 			arg1.varID = *(int*)parg1;
-			arg2.variables = (std::vector<double> *)parg2;
 			break;
 		}
 	}
-	double evaluate()
+};
+
+
+// The modifier expressions of an aperture primitive compiled to postfix stack code when the primitive is defined.
+// Constant subexpressions are folded by the compiler, so a modifier that is a literal number is returned
+// without running any code.
+class ParameterProgram
+{
+	enum OpCode { PUSH_CONSTANT, PUSH_VARIABLE, OPMUL, OPDIV, OPADD, OPSUB, OPNEG };
+
+	struct Instruction
 	{
-		switch (type)
-		{
-		case OPNEG:		return -arg1.node->evaluate();
-		case OPADD:		return arg1.node->evaluate() + arg2.node->evaluate();
-		case OPSUB:		return arg1.node->evaluate() - arg2.node->evaluate();
-		case OPMUL:		return arg1.node->evaluate() * arg2.node->evaluate();
-		case OPDIV:
-			{
-				double d = arg2.node->evaluate();
-				if (d == 0) throw std::string("division by zero");
-				return arg1.node->evaluate() / d;
-			}
-		case CONSTANT:	return arg1.value;
-		case VAR:
-			if (arg1.varID >= arg2.variables->size())
-			{
-				std::ostringstream oss;
-				oss<<"variable $"<<(arg1.varID+1)<<" has not been assigned";
-				throw oss.str();
-			}
-			return (*arg2.variables)[arg1.varID];
-		}
-	}
+		OpCode op;
+		int varID;
+		double value;
+	};
+
+	std::vector<Instruction> code;
+	std::vector<int> start;					// first instruction of each expression, followed by the end of the code
+	std::vector<int> highestVariable;		// highest variable index used by each expression, or -1
+	mutable std::vector<double> stack;		// evaluation stack, sized for the deepest expression
+	const std::vector<double> *variables;	// modifiers of the AD block being rendered
+
+	void emit(const NodeT *node, int &depth, int &maxDepth);
+	void throwUnassigned(int index) const;
+
+public:
+	ParameterProgram() : start(1, 0), variables(0) { }
+
+	void compile(const std::vector<NodeT *> &expressions, const std::vector<double> &variables);
+	size_t size() const		{ return highestVariable.size(); }
+	double evaluate(int index) const;
+	void appendKey(std::string &key) const;
 };
 
 class Gerber;
@@ -120,32 +126,87 @@ class Aperture
 						PRIMITIVE_INVALID = -1
 						} primitive;
 
-        Aperture * composite;					// points to the next Aperture object for a composite macro aperture
+        int primitiveCount;						// number of primitives of the aperture from this one, which follow it in Gerber::apertures
         int linenum_at_definition;				// line in Gerber file where aperture was defined
         const char * rs274x_name();				// name of aperture type described in RS-274X
 		double grow_size;						// number of pixels to expand all object outlines
 		double standardApWidth;					// Holds the width and height for a standard type aperture (equals 0 for Special Ap.)
 		double standardApHeight;				//  used to determine track width when linear and arc drawing plotting
+		double scale[2];						// scale factor in effect at the definition, applied to the polygons
 
 
-		std::vector< NodeT  * > parameter;
+		ParameterProgram parameters;
 
         int   		DCode;
         std::string nameMacro;
         std::list<Polygon> 	polygons;			// A list of polygons that making up this aperture. Created by member render()
+        int shapeGroup;							// index of the shape group flashed for this aperture and its composites, or -1
 
         double getParameter(int index);
-		void render(const double dots_per_unit, const double grow_size, int ADmodifierCount );
+		void render(const double dots_per_unit, const double grow_size, int ADmodifierCount, Arena<VertexData> &vertexArena );
 
         Aperture()
         {
         	standardApWidth = 0;
         	standardApHeight = 0;
-            composite = 0;
+        	scale[0] = scale[1] = 1;
+            primitiveCount = 1;
             primitive = PRIMITIVE_INVALID;
             DCode = -1;
+            shapeGroup = -1;
         }
 };
 
 
+/*
+ * Rendered apertures shared by all Gerber files read by the process. An aperture is found by a key made of its
+ * compiled primitives and the modifiers, resolution, grow and scale it is rendered with, so the same definition
+ * under another D code, name or file is rendered only once. The vertex data of the rendered primitives is owned
+ * by the cache and never changed; scanTable() makes an initialised copy for each image transform.
+ *
+ * When a directory is set, scan tables are also kept there between runs, one file for each, named by a hash of
+ * the vertices and transform they are made from. The least recently used files are removed once the files
+ * exceed the size limit.
+ *
+ * Files parsed on several threads share the cache. The mutex must be held from find() until the rendered
+ * apertures are inserted, as they are rendered into vertexArena; scanTable() holds it itself.
+ */
+class ApertureCache
+{
+	std::map< std::string, std::vector<Aperture> > apertures;
+	std::map< std::pair<VertexData *, std::vector<double> >, VertexData *> scanTables;
+
+	std::string directory;					// directory of the scan table files, empty for none
+	unsigned long long directoryLimit;		// bytes the scan table files may use
+	unsigned long long directoryBytes;		// bytes used, approximate between evictions
+	VertexData * loadScanTable(const std::string &key, const std::string &path);
+	void saveScanTable(const std::string &key, const std::string &path, const VertexData *vd);
+	void evict();
+
+public:
+	enum { FILE_VERSION = 2 };				// changed whenever the file layout or the scan conversion changes
+	Mutex mutex;
+	Arena<VertexData> vertexArena;
+	unsigned long hitCount;
+	unsigned long missCount;
+	unsigned long scanTableHitCount;
+	unsigned long scanTableMissCount;
+	unsigned long fileHitCount;				// scan tables read from the directory
+	unsigned long fileMissCount;			// scan tables made and written to the directory
+	unsigned long fileEvictCount;			// files removed to keep within the size limit
+
+	ApertureCache() : directoryLimit(0), directoryBytes(0), hitCount(0), missCount(0), scanTableHitCount(0),
+						scanTableMissCount(0), fileHitCount(0), fileMissCount(0), fileEvictCount(0) { }
+
+	bool setDirectory(const std::string &path, unsigned long long maxBytes);
+	bool hasDirectory() const		{ return !directory.empty(); }
+
+	static std::string key(const std::vector<Aperture> &primitives, const std::vector<double> &modifiers,
+							double dotsPerUnit, double growSize, const double scale[2]);
+	std::vector<Aperture> * find(const std::string &key);
+	std::vector<Aperture> & insert(const std::string &key, const std::vector<Aperture> &rendered);
+	VertexData * scanTable(VertexData *vd, const Transform &image);
+};
+
+
 #endif  // APERTURES_H_
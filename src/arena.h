@@ -0,0 +1,117 @@
+/*	Arena allocator for objects that live as long as the Gerber file that created them
+
+	copyright (c), 2001 Adam Seychell.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+
+/*
+ * Memory for the objects of an arena, in chunks of chunkSize objects of objectSize bytes. The placement new and
+ * delete operators below take this base class rather than Arena<T>, as g++ -Wall reports template placement
+ * operators as a mismatched new / delete pair.
+ */
+class ArenaMemory
+{
+	ArenaMemory(const ArenaMemory &);			// not copyable
+	ArenaMemory & operator=(const ArenaMemory &);
+
+protected:
+	std::vector<char *> chunks;
+	size_t objectSize;			// size of an object in bytes
+	size_t chunkSize;			// number of objects per chunk
+	size_t used;				// number of objects in the last chunk
+	size_t count;				// total number of objects
+
+	ArenaMemory(size_t object_size, size_t chunk_size) : objectSize(object_size), chunkSize(chunk_size), used(0), count(0) { }
+
+public:
+	void * allocate()
+	{
+		if (chunks.empty() || used == chunkSize)
+		{
+			chunks.push_back( static_cast<char *>(::operator new(chunkSize * objectSize)) );
+			used = 0;
+		}
+		count++;
+		return chunks.back() + objectSize * used++;
+	}
+
+	// Return the memory of the last allocation, used when its constructor has thrown.
+	void unallocate(void *p)
+	{
+		if (!chunks.empty() && used > 0 && p == chunks.back() + objectSize * (used - 1))
+		{
+			used--;
+			count--;
+		}
+	}
+
+	size_t size() const		{ return count; }
+	size_t bytes() const	{ return chunks.size() * chunkSize * objectSize; }
+};
+
+
+/*
+ * Objects of type T are constructed in chunks of memory owned by the arena with
+ *
+ *     T *p = new (arena) T(...);
+ *
+ * and are all destroyed together when the arena is released or destroyed. Such objects must never be deleted.
+ */
+template<class T> class Arena : public ArenaMemory
+{
+public:
+	Arena(size_t chunk_size = 256) : ArenaMemory(sizeof(T), chunk_size) { }
+	~Arena() { release(); }
+
+	// Destroy all objects and free the memory
+	void release()
+	{
+		for (size_t k=0; k < chunks.size(); k++)
+		{
+			T *objects = reinterpret_cast<T *>(chunks[k]);
+			size_t n = (k+1 == chunks.size()) ? used : chunkSize;
+			for (size_t i=0; i < n; i++)
+				objects[i].~T();
+			::operator delete(chunks[k]);
+		}
+		chunks.clear();
+		used = count = 0;
+	}
+};
+
+
+inline void * operator new(size_t, ArenaMemory &arena)
+{
+	return arena.allocate();
+}
+
+inline void operator delete(void *p, ArenaMemory &arena)
+{
+	arena.unallocate(p);
+}
+
+
+#endif /*ARENA_H_*/
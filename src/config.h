@@ -16,6 +16,9 @@
 /* Define to 1 if you have the <libintl.h> header file. */
 #define HAVE_LIBINTL_H 1
 
+/* Define to 1 if you have the 'pthread' library (-lpthread). */
+#define HAVE_LIBPTHREAD 1
+
 /* Define to 1 if you have the 'tiff' library (-ltiff). */
 #define HAVE_LIBTIFF 1
 
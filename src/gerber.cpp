@@ -25,8 +25,14 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include <vector>
 #include <list>
+#include <set>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #pragma hdrstop
 using namespace::std;
@@ -38,12 +44,17 @@ using namespace::std;
 
 
 
-void yyerror( Gerber *g, const char * bisonMessage)
+// The flex scanner keeps its input and state in globals, so only one file is scanned at a time.
+// The parser itself is reentrant, and data blocks read by the memory mapped scanner need no lock.
+static Mutex scannerMutex;
+
+
+void yyerror( const char * bisonMessage, int token)
 {
 	string str = bisonMessage;
-    size_t found = str.find("$undefined");			// replace the "$undefined" word in bison error string
-    if (found!=string::npos)
-    	str.replace(found, string::npos, "'" + string(yytext) + "'");
+	size_t found = str.find("invalid token");		// replace the "invalid token" words in bison error string
+	if (found!=string::npos && token > 0 && token < 256)
+		str.replace(found, string::npos, "'" + string(1, char(token)) + "'");
 	throw (str);
 }
 
@@ -125,25 +136,282 @@ double Gerber::dotsPerUnit()
 
 
 //
-// Flash Aperture. Adds the polygon of the currently selected aperture to the polygon list, including sub aperture.
+// Flash Aperture. Adds a flash of the currently selected aperture, including sub aperture, to the flash list.
+// The polygons are only created when the flash is reached in the rasterizer.
 //
 void Gerber::flashAperture(double x, double y)
 {
-	// Aperture::composite points to aperture in the link list that must be plotted in succession.
-	Aperture * arp = &*(apertureSelect);
-	while (arp)
+	flushStroke();
+	Aperture * ap = &apertures[apertureSelect];
+	if (ap->shapeGroup < 0)
+	{
+		// The primitives of a composite aperture follow the first one in #apertures and are plotted in succession.
+		ap->shapeGroup = shapeGroups.size();
+		shapeGroups.push_back( ShapeGroup() );
+		for (Aperture * arp = ap; arp < ap + ap->primitiveCount; arp++)
+			for (list<Polygon>::iterator it = arp->polygons.begin(); it != arp->polygons.end(); it++)
+				shapeGroups.back().push_back( it->vdata, it->polarity );
+	}
+
+	// invert all sub polygons polarity when %PLC*% parameter specified.
+	// The flash is drawn after the polygons added so far, which its sequence number records.
+	flashes.push_back( ap->shapeGroup, Point(x * scaleFactor[0], - y * scaleFactor[1]), layerPolarityClear, polygons.size() );
+}
+
+
+
+
+/*
+ * Start a Step and Repeat block of x by y copies with step distances i and j pixels, after ending any current block.
+ */
+void Gerber::beginStepRepeat(int x, int y, double i, double j)
+{
+	endStepRepeat();
+	if (x < 1 || y < 1)
+		throw string("SR repeat count must be >= 1");
+	repeat.X = x;
+	repeat.Y = y;
+	repeat.I = i;
+	repeat.J = j;
+	repeat.firstPolygon = polygons.size();
+	repeat.firstFlash = flashes.size();
+}
+
+
+/*
+ * End the current Step and Repeat block. The polygons and flashes drawn in the block are repeated at each step position.
+ * The copies share the vertex data, hence the scan line data, of the original polygons.
+ * Offsets are rounded to whole pixels when plotted, so the distance of each copy from the original is rounded to
+ * whole pixels here, once for all its polygons and flashes. Every copy is then the exact image of the original moved
+ * by a whole number of pixels, and is within half a pixel of its true position.
+ */
+void Gerber::endStepRepeat()
+{
+	flushStroke();
+	size_t last = polygons.size();
+	size_t lastFlash = flashes.size();
+	for (int y=0; y < repeat.Y; y++)
+	{
+		for (int x=0; x < repeat.X; x++)
+		{
+			if (x == 0 && y == 0)
+				continue;
+			Point step( floor(x * repeat.I * scaleFactor[0] + 0.5), floor(- y * repeat.J * scaleFactor[1] + 0.5) );
+			int sequence = polygons.size() - repeat.firstPolygon;	// moves the sequence numbers of the flashes to this copy
+			for (size_t i=repeat.firstPolygon; i < last; i++)
+				polygons.push_back( polygons.vdata[i], polygons.offset[i] + step, Polarity_t(polygons.polarity[i]) );
+			for (size_t i=repeat.firstFlash; i < lastFlash; i++)
+				flashes.push_back( flashes.group[i], flashes.offset[i] + step, flashes.isClear[i], flashes.run[i] + sequence );
+		}
+	}
+	repeat.X = repeat.Y = 1;
+	repeat.I = repeat.J = 0;
+	repeat.firstPolygon = polygons.size();
+	repeat.firstFlash = flashes.size();
+}
+
+
+
+/*
+ * Split the scaled position of a tool point into a whole pixel polygon offset, which is returned, and the fraction
+ * of a pixel left over. Polygon offsets are rounded to whole pixels when plotted, so the fraction must be added to
+ * the vertices instead.
+ */
+Point Gerber::pixelOffset(const Point &p, Point &fraction)
+{
+	Point offset(p.x * scaleFactor[0], - p.y * scaleFactor[1]);
+	Point whole( floor(offset.x), floor(offset.y) );
+	fraction = offset - whole;
+	return whole;
+}
+
+
+/*
+ * Add a trace polygon positioned at the start point, in unscaled tool coordinates.
+ * A trace polygon of the same shape and pixel fraction made earlier has its vertex data reused and false is returned.
+ * Otherwise the polygon gets new empty vertex data, to be filled by the caller relative to the start point, scaled
+ * and shifted by the returned fraction, and true is returned.
+ */
+bool Gerber::addTracePolygon(const vector<long> &shape, const Point &start, bool isClear, Point &fraction)
+{
+	Point offset = pixelOffset(start, fraction);
+	Polarity_t polarity = isClear ? CLEAR : DARK;	// polygon polarity dependent on PLC / PLD parameters
+	traceShapeCount++;
+
+	vector<long> key(shape);
+	key.push_back( lround(fraction.x * 256) );
+	key.push_back( lround(fraction.y * 256) );
+	map< vector<long>, VertexData *>::iterator it = traceShapes.find(key);
+	if (it != traceShapes.end())
+	{
+		polygons.push_back( it->second, offset, polarity);
+		traceShapeSharedCount++;
+		return false;
+	}
+	polygons.push_back( new (vertexArena) VertexData, offset, polarity);
+	traceShapes[key] = polygons.vdata.back();
+	vertexdata.push_back( polygons.vdata.back() ); 	// Save pointer to vertex data for the newly created Polygon
+	return true;
+}
+
+
+// the diameter of round traces matches the polygon of a flashed circle aperture. That was scaled by the scale factor
+// of the aperture definition, while the trace is scaled by the current one.
+double Gerber::roundTraceWidth(const Aperture &ap)
+{
+	double width = ap.standardApWidth + growSize;
+	if (width < 1) width = 1;
+	return width * fabs(ap.scale[0] / scaleFactor[0]);
+}
+
+
+// A dirty fix to avoid polygon slivers narrower than 1 pixel, as the polygon filling routines currently do not
+// correctly plot such slivers. The aperture height is limited to minimum value so that after scaling,
+// the trace width is always >= 1 pixel
+double Gerber::rectangleTraceHeight(const Aperture &ap)
+{
+	double height = ap.standardApHeight;
+	double f = fabs(scaleFactor[1]);
+	if (f > 1e-10 && height * f < 1.1)
+		height = 1.1/f;
+	return height;
+}
+
+
+/*
+ * Add a single trace from start to end of a round aperture as a capsule, or of a rectangle aperture as the hexagon
+ * swept by the rectangle.
+ * Trace polygons are made relative to the start point and positioned by the polygon offset, so the
+ * many segments of equal length, direction and width found in buses share a single set of scan line data.
+ * The shape key is in pixel units.
+ */
+void Gerber::addTrace(const Aperture &ap, const Point &start, const Point &end, bool isClear)
+{
+	double dX = end.x - start.x;
+	double dY = end.y - start.y;
+	vector<long> shape(5);
+	Point fraction;
+	shape[1] = lround(dX * scaleFactor[0] * 256);
+	shape[2] = lround(dY * scaleFactor[1] * 256);
+
+	if (ap.primitive == Aperture::STANDARD_CIRCLE)
+	{
+		double width = roundTraceWidth(ap);
+		shape[0] = 0;
+		shape[3] = lround(width * fabs(scaleFactor[0]) * 256);
+		if (addTracePolygon(shape, start, isClear, fraction))
+		{
+			polygons.vdata.back()->setCapsule( Point(0, 0), Point(dX, dY), width/2);
+			polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+			polygons.vdata.back()->shift(fraction.x, fraction.y);
+		}
+		return;
+	}
+
+	double polygon_width  = ap.standardApWidth;
+	double polygon_heigth = rectangleTraceHeight(ap);
+	shape[0] = 3;
+	shape[3] = lround(polygon_width * fabs(scaleFactor[0]) * 256);
+	shape[4] = lround(polygon_heigth * fabs(scaleFactor[1]) * 256);
+	if (addTracePolygon(shape, start, isClear, fraction))
+	{
+		// half sizes of the rectangle pointing in the direction of the trace
+		double ax = (dX < 0) ? -polygon_width/2 : polygon_width/2;
+		double ay = (dY < 0) ? -polygon_heigth/2 : polygon_heigth/2;
+		// leave out the middle vertex of collinear edges of horizontal and vertical traces
+		polygons.vdata.back()->add(-ax, -ay);
+		if (dY != 0)
+			polygons.vdata.back()->add(ax, -ay);
+		if (dX != 0)
+			polygons.vdata.back()->add(dX+ax, dY-ay);
+		polygons.vdata.back()->add(dX+ax, dY+ay);
+		if (dY != 0)
+			polygons.vdata.back()->add(dX-ax, dY+ay);
+		if (dX != 0)
+			polygons.vdata.back()->add(-ax, ay);
+		polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+		polygons.vdata.back()->shift(fraction.x, fraction.y);
+	}
+}
+
+
+/*
+ * Add the trace (oldX,oldY) to (X,Y) to the pending stroke, which is first ended when the trace does not continue it
+ * with the same aperture and polarity.
+ */
+void Gerber::addStrokeSegment()
+{
+	if (!stroke.points.empty() && (stroke.aperture != apertureSelect || stroke.isClear != layerPolarityClear
+								   || stroke.points.back().x != oldX || stroke.points.back().y != oldY
+								   || stroke.scale[0] != scaleFactor[0] || stroke.scale[1] != scaleFactor[1]))
+		flushStroke();
+	if (stroke.points.empty())
+	{
+		stroke.aperture = apertureSelect;
+		stroke.isClear = layerPolarityClear;
+		stroke.scale[0] = scaleFactor[0];
+		stroke.scale[1] = scaleFactor[1];
+		stroke.points.push_back( Point(oldX, oldY) );
+	}
+	stroke.points.push_back( Point(X, Y) );
+}
+
+
+/*
+ * Add the polygon of the pending stroke. A single trace keeps its own shape so it can be shared with equal traces,
+ * a longer chain becomes one STROKE polygon with a single set of scan line data.
+ * Called before anything else is added, so the polygons stay in drawing order.
+ */
+void Gerber::flushStroke()
+{
+	if (stroke.points.empty())
+		return;
+
+	// draw with the scale factor of the traces
+	const double current[2] = { scaleFactor[0], scaleFactor[1] };
+	scaleFactor[0] = stroke.scale[0];
+	scaleFactor[1] = stroke.scale[1];
+	if (stroke.points.size() == 2)
 	{
-		for (list<Polygon>::iterator it = arp->polygons.begin(); it != arp->polygons.end(); it++)
+		addTrace(apertures[stroke.aperture], stroke.points[0], stroke.points[1], stroke.isClear);
+	}
+	else if (stroke.points.size() > 2)
+	{
+		const Aperture &ap = apertures[stroke.aperture];
+		const Point start = stroke.points[0];
+		vector<Point> polyline;
+		for (size_t i=0; i < stroke.points.size(); i++)
+			polyline.push_back( stroke.points[i] - start );
+
+		double radius = 0;
+		vector<Point> pen;
+		if (ap.primitive == Aperture::STANDARD_CIRCLE)
+		{
+			radius = roundTraceWidth(ap) / 2;
+		}
+		else
 		{
-			polygons.push_back( *it ); // Copy polygon from aperture
-			polygons.back();
-			polygons.back().offset.x = x * scaleFactor[0];
-			polygons.back().offset.y = - y * scaleFactor[1];
-			// invert all sub polygons polarity when %PLC*% parameter specified.
-			if (layerPolarityClear) { polygons.back().polarity = CLEAR; }
+			double w = ap.standardApWidth / 2;
+			double h = rectangleTraceHeight(ap) / 2;
+			pen.push_back( Point(-w, -h) );
+			pen.push_back( Point( w, -h) );
+			pen.push_back( Point( w,  h) );
+			pen.push_back( Point(-w,  h) );
 		}
-		arp = arp->composite;
+
+		Point fraction;
+		Point offset = pixelOffset(start, fraction);
+		polygons.push_back( new (vertexArena) VertexData, offset, stroke.isClear ? CLEAR : DARK);
+		vertexdata.push_back( polygons.vdata.back() ); 	// Save pointer to vertex data for the newly created Polygon
+		polygons.vdata.back()->setStroke(polyline, radius, pen);
+		polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+		polygons.vdata.back()->shift(fraction.x, fraction.y);
+		strokeCount++;
+		strokeSegmentCount += polyline.size() - 1;
 	}
+	scaleFactor[0] = current[0];
+	scaleFactor[1] = current[1];
+	stroke.points.clear();
 }
 
 
@@ -247,36 +515,37 @@ void Gerber::calculateArc(Arc &arc)
 //  the drawing
 double Gerber::getCoordinate( char * text, int axis, bool is_I_J)
 {
-	isDrawingEnabled = true;	// any X, Y, I, J command shall enable the drawing
-
-	if (coordsInts[0] < 0)
-	{
-		warning("FS parameter missing, defaulting to FSLAX23Y23");
-		coordsInts[0] = coordsInts[1] = 2;
-		coordsDecimals[0] = coordsDecimals[1] = 3;
-		isOmitLeadingZeroes = true;
-		isCoordsAbsolute = true;
-	}
-
-	int maxdigits = coordsDecimals[axis] + coordsInts[axis];
-
-	double value = atoi(text);
+	bool isNegative = (text[0] == '-');
 	if (text[0] == '-' || text[0] == '+')  text++;
+	unsigned long long value = 0;		// unsigned, so surplus digits wrap rather than overflow
+	char *p = text;
+	while (unsigned(*p - '0') < 10)
+		value = value * 10 + (*p++ - '0');
+	return decodeCoordinate(isNegative ? -(long long)value : (long long)value, int(p - text), axis, is_I_J);
+}
 
-	int excess_digits = (int)strlen(text) - (coordsDecimals[axis] + coordsInts[axis]);
-	if (excess_digits > 0)
-		warning("found %d surplus digits in coordinate ",excess_digits);
+// Same as getCoordinate() for a coordinate already converted to an integer, written with #digits digits.
+double Gerber::decodeCoordinate( long long integer, int digits, int axis, bool is_I_J)
+{
+	isDrawingEnabled = true;	// any X, Y, I, J command shall enable the drawing
+	coordinateCount++;
 
-	if (isOmitLeadingZeroes)
-		value /= pow(10, double(coordsDecimals[axis]));
-	else
-		value /= pow(10, double( (int)strlen(text) - coordsInts[axis]));		// bug fixed: added int cast to strlen()
+	const CoordinateDecoder &d = coordinateDecoder;
+	if (!d.isValid)
+		specialiseCoordinateDecoder();
 
-	value *= dotsPerUnit();						// convert to pixels
-	if (!is_I_J)
-		value += imageOffsetPixels[axis];		// Offset adjustment,
+	if (digits > d.maxDigits[axis])
+	{
+		warning("found %d surplus digits in coordinate ", digits - d.maxDigits[axis]);
+		if (digits > CoordinateDecoder::MAX_DIGITS)
+			digits = CoordinateDecoder::MAX_DIGITS;
+	}
 
-	if (is_I_J || isCoordsAbsolute)
+	double value = integer * d.scale[axis][digits];
+	if (is_I_J)
+		return value;
+	value += d.offset[axis];					// Offset adjustment,
+	if (isCoordsAbsolute)
 		return value;
 
 	// if coordinates are specified incremental then return new value - previous value
@@ -286,92 +555,132 @@ double Gerber::getCoordinate( char * text, int axis, bool is_I_J)
 
 
 
-//--------------------------------------------------------------------------------------------------
-//						Process AD data block
-//--------------------------------------------------------------------------------------------------
-void Gerber::process_AD_block(int DCode)
+// Fold the FS format, the units and the image offset into a scale per number of digits, so decoding a
+// coordinate is one multiply and add.
+void Gerber::specialiseCoordinateDecoder()
 {
-	int   composite_count = 0;
-	Aperture *arp = 0;
+	if (coordsInts[0] < 0)
+	{
+		warning("FS parameter missing, defaulting to FSLAX23Y23");
+		coordsInts[0] = coordsInts[1] = 2;
+		coordsDecimals[0] = coordsDecimals[1] = 3;
+		isOmitLeadingZeroes = true;
+		isCoordsAbsolute = true;
+	}
 
-	//if aperture D code has already been defined then replace it
-	for (list<Aperture>::iterator it = ad_apertures.begin();  it != ad_apertures.end(); it++)
+	CoordinateDecoder &d = coordinateDecoder;
+	double dots = dotsPerUnit();
+	for (int axis = 0; axis < 2; axis++)
 	{
-		if (it->DCode == DCode)
+		d.maxDigits[axis] = coordsDecimals[axis] + coordsInts[axis];
+		d.offset[axis] = imageOffsetPixels[axis];
+		for (int digits = 0; digits <= CoordinateDecoder::MAX_DIGITS; digits++)
 		{
-			arp = &(*it);
-			break;
+			int decimals = isOmitLeadingZeroes ? coordsDecimals[axis] : digits - coordsInts[axis];
+			d.scale[axis][digits] = dots / pow(10, double(decimals));
 		}
 	}
-	// Create a new aperture object for this AD code.
-	if (arp == 0)
-	{
-		ad_apertures.push_back(Aperture());				// blank aperture
-		arp = &ad_apertures.back();
-	}
+	d.isValid = true;
+}
 
 
 
-	// Aperture type references a previously defined macro aperture. We find a match
-	// to the macro aperture of this name by searching the list.
-	// Search the aperture macro list for matching macro names.
-	// Multiple name matches will occur when there is a Macro Aperture defined
-	// in the Gerber file which has multiple special aperture primitives in the one AM block.
-	// When searching through the link list of Aperture objects we look for all matches of
-	// macro_name. We set Aperture::composite of the current matching object to point to the next
-	// matching Aperture object. Using the Aperture::composite member allows plotting of all primitives when only
-	// only the first primitive in the AM block list is known.
+//--------------------------------------------------------------------------------------------------
+//						Process AD data block
+//--------------------------------------------------------------------------------------------------
+ApertureCache Gerber::apertureCache;
+
+void Gerber::process_AD_block(int DCode)
+{
+	// Aperture type references a previously defined macro aperture, found by its name.
+	// A Macro Aperture defined in the Gerber file with multiple special aperture primitives in the one AM block
+	// makes a composite aperture. Its primitives are copied to consecutive Aperture objects in #apertures, the
+	// first one of which is referred to by the D code. A D code defined again refers to the new copy.
 	// note: apertures having single character names, C, R, O or P have been predefined.
-	for (list<Aperture>::iterator amacro = macro_apertures.begin();  amacro != macro_apertures.end(); amacro++)
+	unordered_map<string, vector<Aperture> >::iterator macro = macros.find(temporaryNameMacro);
+	if (macro == macros.end())
+		{ variables.clear(); oss << "the referring macro aperture name '" << temporaryNameMacro << "' is undefined";  throw oss.str(); }
+
+	// The primitives are rendered once for all files with the same modifiers, resolution, grow and scale.
+	// Their vertex data belongs to the aperture cache, which also makes the scan tables at the end of the file.
+	// Cached apertures are never changed, so they are copied below without holding the lock.
+	const vector<Aperture> &primitives = macro->second;
+	double dots_per_unit = dotsPerUnit();
+	string key = ApertureCache::key(primitives, variables, dots_per_unit, growSize, scaleFactor);
+	vector<Aperture> *rendered;
 	{
-		if (temporaryNameMacro != amacro->nameMacro) continue; 	// search for a macro name match.
-
-		// Subsequent macro name matches mean this aperture is built up of multiple aperture primitives.
-		// The <composite> member points to the subsequent primitive Aperture object as a link list.
-		if (composite_count >= 1)
+		MutexLock lock(apertureCache.mutex);
+		rendered = apertureCache.find(key);
+		if (rendered == 0)
 		{
-			ad_apertures.push_back( *amacro );
-			arp->composite = &ad_apertures.back();		// set composite data member of previous Aperture in list to point to here.
-			arp = &ad_apertures.back();
+			vector<Aperture> copies(primitives);
+			for (size_t k = 0; k < copies.size(); k++)
+			{
+				Aperture *arp = &copies[k];
+				try
+				{
+					arp->render(dots_per_unit, growSize, variables.size(), apertureCache.vertexArena );
+					// New polygons object for this aperture have been created, we can now scale the vertices.
+					for (list<Polygon>::iterator it = arp->polygons.begin(); it != arp->polygons.end(); it++)
+						it->vdata->scale( scaleFactor[0], -scaleFactor[1] );
+				}
+				catch (string msg)
+				{
+					oss <<msg<<" in primitive index "<<k+1<<" ("<<arp->rs274x_name()<<") in macro '"<<macro->first<<"' mapped from D"<<DCode;
+					throw oss.str();
+				}
+			}
+			rendered = &apertureCache.insert(key, copies);
 		}
-		composite_count++;
+	}
 
-		*arp = *amacro;							// Copy entire Macro Aperture object
+	int first = apertures.size();
+	for (size_t k = 0; k < rendered->size(); k++)
+	{
+		apertures.push_back( (*rendered)[k] );	// Copy entire rendered Aperture object
+		Aperture *arp = &apertures.back();
 		arp->DCode = DCode;						// Assigned D number found in this ADD block
 		arp->linenum_at_definition = currentLine;		// record line in Gerber file
-
-		try
-		{
-			arp->render(dotsPerUnit(), growSize, variables.size() );
-			// New polygons object for this aperture have been created, we can now scale the vertices, and save pointer to new vertex data.
-			for (list<Polygon>::iterator it = arp->polygons.begin(); it != arp->polygons.end(); it++)
-			{
-				it->vdata->scale( scaleFactor[0], -scaleFactor[1] );
-				vertexdata.push_back(it->vdata);
-			}
-			if (arp->polygons.size() == 0)		// if aperture is blank then don't add it to the list
-				ad_apertures.pop_back();     	// this should never happen ???????
-		}
-		catch (string msg)
-		{
-			oss <<msg<<" in primitive index "<<composite_count<<" ("<<arp->rs274x_name()<<") in macro '"<<amacro->nameMacro<<"' mapped from D"<<DCode;
-			throw oss.str();
-		}
+		arp->primitiveCount = rendered->size() - k;
+		arp->scale[0] = scaleFactor[0];
+		arp->scale[1] = scaleFactor[1];
 
 #ifdef DEBBUG
-		Debug_print_aperture_info(&(*arp));
+		Debug_print_aperture_info(arp);
 #endif
-
-	} // end of macro name search and finished with
+	}
 
 	variables.clear();
 
-	if (composite_count == 0)
-		{ oss << "the referring macro aperture name '" << temporaryNameMacro << "' is undefined";  throw oss.str(); }
+	// Record the aperture in the D code table, and select the new definition in place of a replaced selected one
+	if (DCode < 0)
+		return;
+	if (apertureSelect >= 0 && apertures[apertureSelect].DCode == DCode)
+		apertureSelect = first;
+	if (DCode < MAX_TABLE_DCODE)
+	{
+		if (DCode >= (int)dcodeTable.size())
+			dcodeTable.resize(DCode + 1, -1);
+		dcodeTable[DCode] = first;
+	}
+	else
+		largeDCodes[DCode] = first;
 
 } // end of AD command block  processing
 
 
+// Index in #apertures of the aperture of a D code, or -1 when it has not been defined
+int Gerber::findAperture(int DCode)
+{
+	if (DCode < 0)
+		return -1;
+	if (DCode < MAX_TABLE_DCODE)
+		return DCode < (int)dcodeTable.size() ? dcodeTable[DCode] : -1;
+	map<int, int>::iterator it = largeDCodes.find(DCode);
+	return it == largeDCodes.end() ? -1 : it->second;
+}
+
+
 
 
 
@@ -394,15 +703,16 @@ void Gerber::process_G_command(int code)
 	{
 		isPolygonFill = false;
 		isDrawingEnabled = false;					// don't draw after polygon exit within current command block
-		polygons.back().vdata->scale(scaleFactor[0], -scaleFactor[1]);
+		polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+		polygons.vdata.back()->simplify();			// when enabled, now the vertices are in pixels
 	}
 	if ( code == 36 &&  isPolygonFill == false )	// new polygon for the current polygon fill command
 	{
+		flushStroke();
 		isLampOn = false;							// Always start with lamp off so tool can be positioned after a G36 command with lamp off
 		isPolygonFill = true;
-		polygons.push_back(Polygon());
-		vertexdata.push_back( polygons.back().vdata ); 	// Save pointer to vertex data for the newly created Polygon
-		if (layerPolarityClear) { polygons.back().polarity = CLEAR; }	// polygon polarity dependent on PLC / PLD parameters
+		polygons.push_back( new (vertexArena) VertexData, Point(0,0), layerPolarityClear ? CLEAR : DARK);	// polygon polarity dependent on PLC / PLD parameters
+		vertexdata.push_back( polygons.vdata.back() ); 	// Save pointer to vertex data for the newly created Polygon
 	}
 }
 
@@ -412,15 +722,10 @@ void Gerber::process_D_command(int code)
 {
 	if (code >= 10)
 	{
-		// search for a Aperture list with a matching D_number, use default aperture if not found.
-		apertureSelect = ad_apertures.begin();
-		apertureSelect++;
-		for (; apertureSelect != ad_apertures.end();  apertureSelect++)
-		{
-			if (code == apertureSelect->DCode ) break;
-		}
-		if (apertureSelect == ad_apertures.end()) {			// default to first in list
-			apertureSelect = ad_apertures.begin();
+		// look up the aperture with a matching D_number, use default aperture if not found.
+		apertureSelect = findAperture(code);
+		if (apertureSelect < 0) {			// default to first in list
+			apertureSelect = 0;
 			warning("Aperture D%d has not been defined", code);
 		}
 	}
@@ -458,69 +763,98 @@ void Gerber::processDataBlock()
 	{
 		if (isPolygonFill)	// Add vertices to polygon
 		{
-			if (polygons.back().empty())
+			if (polygons.vdata.back()->empty())
 			{
-				polygons.back().vdata->add( oldX , oldY);
+				polygons.vdata.back()->add( oldX , oldY);
 			}
 			if ((drawingMode == CIRCLE_CLOCKWISE || drawingMode == CIRCLE_ANTICLOCKWISE) )
 			{
 				Arc arc;
 				calculateArc( arc );
 				if (! arc.isTooSmall)
-					polygons.back().vdata->addArc(arc.start, arc.end, arc.radius, arc.centre.x, arc.centre.y, (drawingMode == CIRCLE_CLOCKWISE));
+					polygons.vdata.back()->addArc(arc.start, arc.end, arc.radius, arc.centre.x, arc.centre.y, (drawingMode == CIRCLE_CLOCKWISE));
 				else
-					polygons.back().vdata->add( X , Y);
+					polygons.vdata.back()->add( X , Y);
 			}
 			else
 			{
-				polygons.back().vdata->add( X , Y);
+				polygons.vdata.back()->add( X , Y);
 			}
 		}
 		// draw a trace (line or arc)
 		else 	// Draw to current tool position
 		{
+			Aperture &selected = apertures[apertureSelect];
+
 			// Warn user we are about to use default aperture
-			if (!isWarnNoApertureSelect && (apertureSelect == ad_apertures.begin()))
+			if (!isWarnNoApertureSelect && (apertureSelect == 0))
 			{
 				warning("Drawing started without aperture select. Using default");
 				isWarnNoApertureSelect = true;
 			}
 			// Check if a suitable aperture is selected for the drawing mode.
-			if ( ((drawingMode == CIRCLE_CLOCKWISE || drawingMode == CIRCLE_ANTICLOCKWISE) && apertureSelect->primitive != Aperture::STANDARD_CIRCLE )
-					|| (drawingMode == LINEAR_1X &&  (apertureSelect->primitive != Aperture::STANDARD_CIRCLE && apertureSelect->primitive != Aperture::STANDARD_RECTANGLE)))
+			if ( ((drawingMode == CIRCLE_CLOCKWISE || drawingMode == CIRCLE_ANTICLOCKWISE) && selected.primitive != Aperture::STANDARD_CIRCLE )
+					|| (drawingMode == LINEAR_1X &&  (selected.primitive != Aperture::STANDARD_CIRCLE && selected.primitive != Aperture::STANDARD_RECTANGLE)))
 			{
-				oss <<"D"<<apertureSelect->DCode<<" mapped to ("<<apertureSelect->rs274x_name()<<") aperture which is not supported for drawing traces\n"<<
+				oss <<"D"<<selected.DCode<<" mapped to ("<<selected.rs274x_name()<<") aperture which is not supported for drawing traces\n"<<
 				"Supported shapes are:\n"
 				" C or R     for linear traces\n"
 				" C          for arc traces\n";
 				throw oss.str();
 			}
 
+			// Traces of a round aperture are drawn as a single capsule (line) or sector (arc) polygon which includes both
+			// round ends, so no flashes are required. These must stay circular, hence are only used when X and Y scale are equal,
+			// both now and at the aperture definition.
+			bool isRoundTrace = selected.primitive == Aperture::STANDARD_CIRCLE && fabs(scaleFactor[0]) == fabs(scaleFactor[1])
+								&& fabs(selected.scale[0]) == fabs(selected.scale[1]) && scaleFactor[0] != 0;
+			bool isChainBroken = lastDrawnApertureSelect != apertureSelect || lastDrawnX != oldX || lastDrawnY != oldY;
+
+			// Linear traces of a plain rectangle aperture are drawn as the hexagon swept by the rectangle, which covers
+			// the flashes at both ends. The flashes were scaled when the aperture was defined, so the scale must not have changed.
+			bool isSweptTrace = drawingMode == LINEAR_1X && toolShift > 1 && selected.primitive == Aperture::STANDARD_RECTANGLE
+								&& selected.polygons.size() == 1 && selected.primitiveCount == 1
+								&& selected.scale[0] == scaleFactor[0] && selected.scale[1] == scaleFactor[1];
+
 			// Flash at start of line or arc if last draw was at a different position or different aperture
-			if ( lastDrawnApertureSelect != apertureSelect || lastDrawnX != oldX || lastDrawnY != oldY )
+			if ( isChainBroken && !isRoundTrace && !isSweptTrace )
 			{
-	//			printf("init flashed %d (%f,%f)\n",apertureSelect->DCode, oldX,oldY );
+	//			printf("init flashed %d (%f,%f)\n",selected.DCode, oldX,oldY );
 				flashAperture(oldX, oldY);
 			}
+			else if (isChainBroken && isSweptTrace)
+				redundantFlashCount++;
 
 			// Get size of the circle (C) or rectangle (R) type polygon.
-			double polygon_width  = apertureSelect->standardApWidth;
-			double polygon_heigth = apertureSelect->standardApHeight;
-
-			// A dirty fix to avoid polygon slivers narrower than 1 pixel, as the polygon filling routines currently do not
-			// correctly plot such slivers. The aperture height is limited to minimum value so that after scaling,
-			// the trace width is always >= 1 pixel
-			double f = fabs(scaleFactor[1]);
-			if (f > 1e-10 && polygon_heigth * f < 1.1)
-				polygon_heigth = 1.1/f;
+			double polygon_width  = selected.standardApWidth;
+			double polygon_heigth = rectangleTraceHeight(selected);
 
-			if (drawingMode == LINEAR_1X)
+			// Round and swept traces are collected into a stroke, drawn when the chain of traces ends.
+			if (drawingMode == LINEAR_1X && isRoundTrace)
+			{
+				if (toolShift > 0 || isChainBroken)	// a zero length capsule is a circle, needed when not joined to the last trace
+					addStrokeSegment();
+			}
+			else if (drawingMode == LINEAR_1X && isSweptTrace)
 			{
+				addStrokeSegment();
+				redundantFlashCount++;			// the flash at the end
+			}
+			else if (drawingMode == LINEAR_1X)
+			{
+				flushStroke();
 				if (toolShift > 1)			// don't bother drawing traces of tiny length
 				{
 					double sy, sx;
+					Point fraction;
+					vector<long> shape(5);
+					shape[0] = selected.primitive == Aperture::STANDARD_CIRCLE ? 1 : 2;
+					shape[1] = lround(dX * scaleFactor[0] * 256);
+					shape[2] = lround(dY * scaleFactor[1] * 256);
+					shape[3] = lround(polygon_width * fabs(scaleFactor[0]) * 256);
+					shape[4] = lround(polygon_heigth * fabs(scaleFactor[1]) * 256);
 					// width of line or arc draw by using height of the polygon for this aperture.
-					if ( apertureSelect->primitive == Aperture::STANDARD_CIRCLE )
+					if ( selected.primitive == Aperture::STANDARD_CIRCLE )
 					{
 						// assume trance width is diameter of circle or polygon height.
 						double traceWidth = max(polygon_heigth, polygon_width);
@@ -540,14 +874,15 @@ void Gerber::processDataBlock()
 						if ((dX*dY) < 0)
 							sx *= -1;
 					}
-					polygons.push_back(Polygon());
-					vertexdata.push_back( polygons.back().vdata ); 	// Save pointer to vertex data for the newly created Polygon
-					if (layerPolarityClear) { polygons.back().polarity = CLEAR; }	// polygon polarity dependent on PLC / PLD parameters
-					polygons.back().vdata->add(oldX+sx, oldY+sy);
-					polygons.back().vdata->add(oldX-sx, oldY-sy);
-					polygons.back().vdata->add(X-sx, Y-sy);
-					polygons.back().vdata->add(X+sx, Y+sy);
-					polygons.back().vdata->scale(scaleFactor[0], -scaleFactor[1]);
+					if (addTracePolygon(shape, Point(oldX, oldY), layerPolarityClear, fraction))
+					{
+						polygons.vdata.back()->add(sx, sy);
+						polygons.vdata.back()->add(-sx, -sy);
+						polygons.vdata.back()->add(dX-sx, dY-sy);
+						polygons.vdata.back()->add(dX+sx, dY+sy);
+						polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+						polygons.vdata.back()->shift(fraction.x, fraction.y);
+					}
 
 				}
 				if (toolShift > 0)		// don't flash when line length is exactly zero because the initial flash is acceptable.
@@ -558,16 +893,25 @@ void Gerber::processDataBlock()
 			// Draw ARC -----------------------------------------------------------------------
 			else if (drawingMode == CIRCLE_CLOCKWISE || drawingMode == CIRCLE_ANTICLOCKWISE)
 			{
+				flushStroke();
 				Arc arc;
 				calculateArc( arc );
-				if (! arc.isTooSmall )
+				if (! arc.isTooSmall && isRoundTrace)
 				{
-					polygons.push_back(Polygon());
-					vertexdata.push_back( polygons.back().vdata ); 	// Save pointer to vertex data for the newly created Polygon
-					polygons.back().vdata->addArc(arc.start, arc.end, arc.radius - (polygon_heigth)/2, arc.centre.x, arc.centre.y, (drawingMode == CIRCLE_CLOCKWISE));
-					polygons.back().vdata->addArc(arc.end, arc.start, arc.radius + (polygon_heigth)/2, arc.centre.x, arc.centre.y, (drawingMode != CIRCLE_CLOCKWISE));
-					polygons.back().vdata->scale(scaleFactor[0], -scaleFactor[1]);
-					if (layerPolarityClear) { polygons.back().polarity = CLEAR; }	// polygon polarity dependent on PLC / PLD parameters
+					polygons.push_back( new (vertexArena) VertexData, Point(0,0), layerPolarityClear ? CLEAR : DARK);	// polygon polarity dependent on PLC / PLD parameters
+					vertexdata.push_back( polygons.vdata.back() ); 	// Save pointer to vertex data for the newly created Polygon
+					polygons.vdata.back()->setSector(arc.start, arc.end, arc.radius, arc.centre.x, arc.centre.y, (drawingMode == CIRCLE_CLOCKWISE), roundTraceWidth(selected)/2);
+					polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
+					oldX = lastDrawnX = arc.stopped.x;	// set oldX,oldY to stopped point of arc. The sector has a round end here
+					oldY = lastDrawnY = arc.stopped.y;	// so the line to the current tool point is joined without another one.
+				}
+				else if (! arc.isTooSmall )
+				{
+					polygons.push_back( new (vertexArena) VertexData, Point(0,0), layerPolarityClear ? CLEAR : DARK);	// polygon polarity dependent on PLC / PLD parameters
+					vertexdata.push_back( polygons.vdata.back() ); 	// Save pointer to vertex data for the newly created Polygon
+					polygons.vdata.back()->addArc(arc.start, arc.end, arc.radius - (polygon_heigth)/2, arc.centre.x, arc.centre.y, (drawingMode == CIRCLE_CLOCKWISE));
+					polygons.vdata.back()->addArc(arc.end, arc.start, arc.radius + (polygon_heigth)/2, arc.centre.x, arc.centre.y, (drawingMode != CIRCLE_CLOCKWISE));
+					polygons.vdata.back()->scale(scaleFactor[0], -scaleFactor[1]);
 					oldX = arc.stopped.x;				// set oldX,oldY to stopped point of arc
 					oldY = arc.stopped.y;
 				}
@@ -600,6 +944,103 @@ void Gerber::processDataBlock()
 
 
 
+/*
+ * Move the offset of every polygon into its vertices. Offsets are whole pixels, but an image transform that is not a
+ * quarter turn moves them to fractions of a pixel, which would be lost when the offsets are rounded. A vertex set
+ * used by several polygons is copied for each polygon after the first. shareVertexData() shares the transformed
+ * sets again where they are copies at a whole pixel offset.
+ */
+void Gerber::moveOffsetsToVertices()
+{
+	set<VertexData *> used;
+	for (size_t i = 0; i < polygons.size(); i++)
+	{
+		if (!polygons.vdata[i]->empty() && !used.insert(polygons.vdata[i]).second)
+		{
+			polygons.vdata[i] = new (vertexArena) VertexData(*polygons.vdata[i]);
+			vertexdata.push_back( polygons.vdata[i] );
+		}
+	}
+	for (size_t i = 0; i < polygons.size(); i++)
+	{
+		polygons.vdata[i]->shift(polygons.offset[i].x, polygons.offset[i].y);
+		polygons.offset[i] = Point(0, 0);
+	}
+}
+
+
+
+/*
+ * Find vertex sets that are identical apart from a shift by a whole number of pixels, such as repeated G36 regions
+ * or identical trace segments. Shifting by whole pixels shifts the scan line data by exactly the same amount, so the
+ * polygons of such sets can share one set of scan line data with the shift added to their offset.
+ * Vertices are compared relative to the whole pixel below the first vertex, rounded to 1/1024 pixel.
+ *
+ * On return each duplicate set is removed from #vertexdata and #replacements maps it to the shared set and shift.
+ */
+void Gerber::shareVertexData(map<VertexData *, pair<VertexData *, Point> > &replacements)
+{
+	const double quantum = 1024;
+	typedef vector<long long> Key;
+	map<unsigned long long, list< pair<Key, pair<VertexData *, Point> > > > table;
+
+	for (list<VertexData *>::iterator it = vertexdata.begin(); it != vertexdata.end(); )
+	{
+		VertexData *vd = *it;
+		if (vd->empty())
+		{
+			it++;
+			continue;
+		}
+
+		// Build the key from the vertices made relative to a whole pixel position, and the shape parameters.
+		Point origin( floor(vd->vertices[0].x), floor(vd->vertices[0].y) );
+		Key key;
+		key.reserve( 2*vd->vertices.size() + 2*vd->pen.size() + 4 );
+		key.push_back( vd->shape );
+		key.push_back( vd->isClockwise );
+		key.push_back( (long long)floor(vd->radius * quantum + 0.5) );
+		key.push_back( (long long)floor(vd->sweep * quantum * quantum + 0.5) );
+		for (size_t i=0; i < vd->vertices.size(); i++)
+		{
+			key.push_back( (long long)floor((vd->vertices[i].x - origin.x) * quantum + 0.5) );
+			key.push_back( (long long)floor((vd->vertices[i].y - origin.y) * quantum + 0.5) );
+		}
+		for (size_t i=0; i < vd->pen.size(); i++)
+		{
+			key.push_back( (long long)floor(vd->pen[i].x * quantum + 0.5) );
+			key.push_back( (long long)floor(vd->pen[i].y * quantum + 0.5) );
+		}
+
+		// FNV-1a hash of the key
+		unsigned long long hash = 14695981039346656037ULL;
+		for (size_t i=0; i < key.size(); i++)
+		{
+			hash ^= (unsigned long long)key[i];
+			hash *= 1099511628211ULL;
+		}
+
+		list< pair<Key, pair<VertexData *, Point> > > &bucket = table[hash];
+		list< pair<Key, pair<VertexData *, Point> > >::iterator match = bucket.begin();
+		while (match != bucket.end() && match->first != key)
+			match++;
+
+		if (match == bucket.end())
+		{
+			bucket.push_back( make_pair(key, make_pair(vd, origin)) );
+			it++;
+			continue;
+		}
+
+		// A duplicate; its vertices are no longer needed
+		replacements[vd] = make_pair( match->second.first, origin - match->second.second );
+		vector<Point>().swap(vd->vertices);
+		sharedVertexDataCount++;
+		it = vertexdata.erase(it);
+	}
+}
+
+
 /*
  * Initialize all Gerber parameters to default values;
  * this function is called in Gerber constructor and M02 (End of program) commands encounted.
@@ -611,8 +1052,9 @@ void Gerber::processDataBlock()
  */
 void Gerber::loadDefaults()
 {
+	flushStroke();
 	isDrawingEnabled = false;
-	lastDrawnApertureSelect = ad_apertures.begin();
+	lastDrawnApertureSelect = -1;
 	isWarnNoApertureSelect = false;
 	layerPolarityClear = false;
 	scaleFactor[0] = optScaleX;
@@ -622,6 +1064,8 @@ void Gerber::loadDefaults()
 	repeat.Y = 1;
 	repeat.I = 0;
 	repeat.J = 0;
+	repeat.firstPolygon = polygons.size();
+	repeat.firstFlash = flashes.size();
 	isLampOn = false;
 	isMirrorAaxis = false;
 	isMirrorBaxis = false;
@@ -633,31 +1077,36 @@ void Gerber::loadDefaults()
 	// Some gerber files can start drawing without setting both or either X and Y coordinates !
 	oldX = oldY = X = Y = 0;
 	coordPrevious[0]=coordPrevious[1]=0;
+	coordinateDecoder.isValid = false;
 	// Generate artificial macros in the list that represent each of the standard apertures, C, R, O and P.
 	// The macro modifiers will be of variable type, listed from $1 to $5. Note, the P aperture can have up to 5 modifiers.
-	macro_apertures.clear();
-	ad_apertures.clear();
+	macros.clear();
+	apertures.clear();
+	dcodeTable.clear();
+	largeDCodes.clear();
+	apertureSelect = -1;
 	Aperture arp;
-	arp.parameter.resize(5);
 	for (int i=0; i < 5; i++)
 	{
-		arp.parameter[i] = new NodeT(NodeT::VAR, &i, &variables);
+		if (standardParameters[i] == 0)		// created once and reused after each M02
+			standardParameters[i] = new (nodeArena) NodeT(NodeT::VAR, &i);
 	}
+	arp.parameters.compile(vector<NodeT *>(standardParameters, standardParameters + 5), variables);
 	arp.nameMacro = "C";
 	arp.primitive = Aperture::STANDARD_CIRCLE;
-	macro_apertures.push_back(arp);
+	macros[arp.nameMacro].push_back(arp);
 
 	arp.nameMacro = "R";
 	arp.primitive = Aperture::STANDARD_RECTANGLE;
-	macro_apertures.push_back(arp);
+	macros[arp.nameMacro].push_back(arp);
 
 	arp.nameMacro = "O";
 	arp.primitive = Aperture::STANDARD_ORBROUND;
-	macro_apertures.push_back(arp);
+	macros[arp.nameMacro].push_back(arp);
 
 	arp.nameMacro = "P";
 	arp.primitive = Aperture::STANDARD_POLYGON;
-	macro_apertures.push_back(arp);
+	macros[arp.nameMacro].push_back(arp);
 
 
 	// Create an aperture definition consisting of single pixel wide circle.
@@ -667,7 +1116,7 @@ void Gerber::loadDefaults()
 	units = INCH;	// Temporarily set inches just to construct this aperture
 	variables.push_back ( 1.5/dotsPerUnit() );
 	process_AD_block(-1);
-	apertureSelect = ad_apertures.begin();		// select to default aperture
+	apertureSelect = 0;							// select to default aperture
 	units = ut;									// restore previous units
 
 }
@@ -675,6 +1124,236 @@ void Gerber::loadDefaults()
 
 
 
+//--------------------------------------------------------------------------------------------------
+//						Memory mapped scanner
+//
+// A faster front end for regular files. Data blocks are decoded here directly, and only the
+// parameter blocks are passed to the flex scanner and the parser. A data block that uses anything
+// beyond X, Y, I, J, D, G, M commands and white space, and all text after it, is passed to flex as
+// well, so the results are always the same as reading the whole file with flex.
+//--------------------------------------------------------------------------------------------------
+bool Gerber::isFastLexerEnabled = false;
+
+// Characters that produce no token in the flex scanner between blocks
+static inline bool isSkippedByFlex(char c)
+{
+	return !isalnum((unsigned char)c) && !strchr("+%-/(),*.", c);
+}
+
+// Returns false when the file cannot be mapped or includes other files, and nothing was read.
+bool Gerber::parseMappedFile(FILE *fp)
+{
+	int fd = fileno(fp);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || lseek(fd, 0, SEEK_CUR) != 0)
+		return false;
+
+	size_t size = st.st_size;
+	void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	const char *text = (const char *)map;
+
+	// IF parameters open the included file in the flex scanner, so leave such files to it
+	if (memmem(text, size, "IF", 2) != 0)
+	{
+		munmap(map, size);
+		return false;
+	}
+	try
+	{
+		scanMapped(text, text + size);
+	}
+	catch (...)
+	{
+		munmap(map, size);
+		throw;
+	}
+	munmap(map, size);
+	return true;
+}
+
+void Gerber::scanMapped(const char *p, const char *end)
+{
+	bool isEmpty = true;
+	for (;;)
+	{
+		while (p < end && isSkippedByFlex(*p))
+		{
+			if (*p == '\n')
+				currentLine++;
+			p++;
+		}
+		if (p == end)
+			break;
+
+		if (*p == '%')
+		{
+			// A parameter block ends at the next '%' that follows a '*', or directly follows the opening '%'
+			const char *close = (const char *)memchr(p + 1, '%', end - p - 1);
+			if (close == 0)
+				break;
+			const char *q = close;
+			while (q > p + 1 && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r' || q[-1] == '\n'))
+				q--;
+			if (q > p + 1 && q[-1] != '*')
+				break;
+			parseText(p, close + 1);
+			fastParameterBlockCount++;
+			p = close + 1;
+		}
+		else
+		{
+			const char *asterisk = (const char *)memchr(p, '*', end - p);
+			if (asterisk == 0 || !tokeniseDataBlock(p, asterisk))
+				break;
+			fastDataBlockCount++;
+			if (!runDataBlock())
+				return;						// M03, end of program
+			p = asterisk + 1;
+		}
+		isEmpty = false;
+	}
+
+	if (p < end || isEmpty)
+	{
+		isFastLexerFallback = (p < end);
+		parseText(p, end);
+	}
+}
+
+// Split the data block from p to the '*' at end into #blockTokens. Returns false if flex is needed to read it.
+bool Gerber::tokeniseDataBlock(const char *p, const char *end)
+{
+	blockTokens.clear();
+	int lines = 0;
+	bool isPending = false;			// commands not yet ended by the '*' or an M code
+	while (p < end)
+	{
+		char c = *p++;
+		if (c == '\n')
+		{
+			lines++;
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\r')
+			continue;
+
+		BlockToken t;
+		t.code = c;
+		t.lines = lines;
+		lines = 0;
+		switch (c)
+		{
+		case 'G':
+			{
+				// G04, G4 and anything else matching G0*4 is a comment to the end of the block
+				const char *z = p;
+				while (z < end && *z == '0')
+					z++;
+				if (z < end && *z == '4')
+				{
+					t.code = 'C';
+					p = end;
+					break;
+				}
+			}
+			// no break
+		case 'X':
+		case 'Y':
+		case 'I':
+		case 'J':
+		case 'D':
+		case 'M':
+			{
+				bool isNegative = false;
+				if ((c == 'X' || c == 'Y' || c == 'I' || c == 'J') && p < end && (*p == '-' || *p == '+'))
+					isNegative = (*p++ == '-');
+				const char *digits = p;
+				unsigned long long value = 0;
+				while (p < end && unsigned(*p - '0') < 10)
+					value = value * 10 + (*p++ - '0');
+				t.digits = p - digits;
+				t.value = isNegative ? -(long long)value : (long long)value;
+				if (t.digits == 0 || (p < end && *p == '.'))
+					return false;
+			}
+			break;
+		default:
+			return false;
+		}
+
+		if (t.code == 'M')
+		{
+			if (t.value > 3 || (t.value == 3 && isPending))
+				return false;
+			isPending = false;
+		}
+		else
+			isPending = true;
+		blockTokens.push_back(t);
+	}
+	blockLines = lines;
+	return true;
+}
+
+// Carry out the commands in #blockTokens as the parser would. Returns false at the end of program.
+bool Gerber::runDataBlock()
+{
+	bool isPending = false;
+	for (size_t i = 0; i < blockTokens.size(); i++)
+	{
+		const BlockToken &t = blockTokens[i];
+		currentLine += t.lines;
+		switch (t.code)
+		{
+		case 'X':	X = decodeCoordinate(t.value, t.digits, 0, false);	break;
+		case 'Y':	Y = decodeCoordinate(t.value, t.digits, 1, false);	break;
+		case 'I':	I = decodeCoordinate(t.value, t.digits, 0, true);	break;
+		case 'J':	J = decodeCoordinate(t.value, t.digits, 1, true);	break;
+		case 'D':	process_D_command(t.value);	break;
+		case 'G':	process_G_command(t.value);	break;
+		case 'M':
+			if (t.value == 3)
+				return false;
+			if (t.value == 2)
+			{
+				endStepRepeat();
+				loadDefaults();
+			}
+			if (isPending)
+				processDataBlock();
+			isPending = false;
+			continue;
+		}
+		isPending = true;
+	}
+	currentLine += blockLines;
+	if (isPending)
+		processDataBlock();
+	return true;
+}
+
+// Read the text from p to end with the flex scanner and the parser
+void Gerber::parseText(const char *p, const char *end)
+{
+	MutexLock lock(scannerMutex);
+	yy_scan_bytes(p, end - p);
+	try
+	{
+		yyparse(this);
+	}
+	catch (...)
+	{
+		yylex_destroy();
+		throw;
+	}
+	yylex_destroy();
+}
+
+
+
+
 // ***********************************************************************
 // The Gerber constructor. This is the function called by the user to parse
 // the Gerber RS-274X file and create drawing information so the image can
@@ -693,58 +1372,160 @@ void Gerber::loadDefaults()
 // contain useful information.
 //
 // *****************************************************************************
-Gerber::Gerber(FILE * fp_gerb, const double dotsPerInch, const double growSize, double optScaleX, double optScaleY)
+Gerber::Gerber(FILE * fp_gerb, const double dotsPerInch, const double growSize, double optScaleX, double optScaleY, double optRotation,
+			   bool optMirrorX, bool optMirrorY)
 	: dotsPerInch(dotsPerInch), growSize(growSize)
 	 ,optScaleX(optScaleX), optScaleY(optScaleY)
 {
+	const VertexStatistics startStatistics = VertexData::statistics();
     try
     {
     	imageRotate = 0;
     	imagePolarityDark = true;
     	isError = false;
     	warningCount = 0;
+    	sharedVertexDataCount = 0;
+    	traceShapeCount = traceShapeSharedCount = 0;
+    	polarityRunCount = 0;
+    	redundantFlashCount = 0;
+    	strokeCount = strokeSegmentCount = 0;
+    	fastDataBlockCount = fastParameterBlockCount = 0;
+    	isFastLexerFallback = false;
+    	coordinateCount = 0;
+    	parseSeconds = 0;
+		for (int i=0; i < 5; i++)
+			standardParameters[i] = 0;
 		currentLine = 1;
 		coordsInts[0] = -1;					// assign to negative value until FS parameter encounter
 		units = UNDEFINED;
 
 		loadDefaults();
-		yyrestart(fp_gerb);					// set a new input file for FLEX, flushes input buffer.
-    	yyparse(this);
-
-    	// Modify then Initialise all vertices used by the polygons
+		double start = threadSeconds();
+		if (!isFastLexerEnabled || !parseMappedFile(fp_gerb))
+		{
+			MutexLock lock(scannerMutex);
+			yyrestart(fp_gerb);					// set a new input file for FLEX, flushes input buffer.
+	    	yyparse(this);
+		}
+		parseSeconds = threadSeconds() - start;
+    	endStepRepeat();					// an SR block open at end of file ends here
+
+    	// Modify then Initialise all vertices used by the polygons.
+        // Scaling and mirroring (SF, MI and the scale options) are done as each object is made, as they may change
+        // within the file. The rotation of the entire image specified by the IR parameter and the rotation option
+        // (degrees anticlockwise as seen in the image, where y points down) and the mirror options, which flip the
+        // rotated image, are combined in a single transform. Quarter turns and mirrors are exact so they cost nothing.
+        Transform image = Transform::mirror(optMirrorX, optMirrorY)
+        				* Transform::rotation(-optRotation * M_PI/180) * Transform::rotation(imageRotate);
+        if (!image.isQuarterTurn())
+        	moveOffsetsToVertices();
+        if (!image.isIdentity())
+        	for (list<VertexData *>::iterator it = vertexdata.begin(); it != vertexdata.end(); it++)
+        		(*it)->transform(image);
+        map<VertexData *, pair<VertexData *, Point> > replacements;
+        shareVertexData(replacements);
         for (list<VertexData *>::iterator it = vertexdata.begin(); it != vertexdata.end(); it++)
         {
-        	(*it)->rotate(imageRotate);	// Rotate the vertices specified by the Image Rotate parameter.
         	(*it)->initialise();
         }
 
-    	// Initialise the polygons
+        // The shape groups hold the vertex data of cached apertures. Use the scan tables the cache has made
+        // of them for this transform, and remove groups polygons without vertices.
+        for (size_t g = 0; g < shapeGroups.size(); g++)
+        {
+        	ShapeGroup &group = shapeGroups[g];
+        	for (size_t j = 0; j < group.size(); j++)
+        		group.vdata[j] = apertureCache.scanTable(group.vdata[j], image);
+        	group.removeEmpty();
+        }
+
+    	// Initialise the polygons and flashes, removing empty ones.
+        // Split them into runs of equal polarity, in the order specified in gerber file. A flash comes before
+        // the polygon its sequence number refers to. Only the order of the runs affects the image, so polygons
+        // within a run may be drawn in any order, and a flash repeated within a run can be left out.
     	int k = 0;
-        for (list<Polygon>::iterator it = polygons.begin(); it != polygons.end(); )
+    	size_t f = 0, kf = 0;
+    	int lastPolarity = -1;
+    	polarityRunCount = 0;
+    	set< pair<int, pair<double, double> > > runFlashes;		// group and position of the flashes in the current run
+        for (size_t i = 0; i <= polygons.size(); i++)
         {
-        	if (it->empty())
+        	for ( ; f < flashes.size() && (i == polygons.size() || flashes.run[f] <= int(i)); f++)
         	{
-        		it = polygons.erase(it);
-        		continue;
+        		const ShapeGroup &group = shapeGroups[ flashes.group[f] ];
+        		if (group.size() == 0)
+        			continue;
+
+            	int first = flashes.isClear[f] ? CLEAR : group.polarity.front();
+            	if (first != lastPolarity)
+            	{
+            		polarityRunCount++;
+            		runFlashes.clear();
+            	}
+            	if (group.runCount(flashes.isClear[f]) == 1)
+            	{
+            		int id = 2*flashes.group[f] + flashes.isClear[f];
+            		if (!runFlashes.insert( make_pair(id, make_pair(flashes.offset[f].x, flashes.offset[f].y)) ).second)
+            		{
+            			redundantFlashCount++;
+            			continue;
+            		}
+            	}
+
+            	flashes.offset[f] = image(flashes.offset[f]);
+            	flashes.group[kf] = flashes.group[f];
+            	flashes.offset[kf] = flashes.offset[f];
+            	flashes.isClear[kf] = flashes.isClear[f];
+            	flashes.initialise(kf, shapeGroups);
+            	flashes.run[kf] = polarityRunCount - 1;
+            	if (group.runCount(flashes.isClear[kf]) > 1)
+            	{
+            		polarityRunCount += group.runCount(flashes.isClear[kf]) - 1;
+            		runFlashes.clear();
+            	}
+            	lastPolarity = flashes.isClear[kf] ? CLEAR : group.polarity.back();
+            	kf++;
+        	}
+        	if (i == polygons.size())
+        		break;
+
+        	// Move the polygon by the image transform
+        	polygons.offset[i] = image(polygons.offset[i]);
+
+        	// Use the shared vertex set when this one was found to be a copy at a whole pixel offset
+        	map<VertexData *, pair<VertexData *, Point> >::iterator rit = replacements.find(polygons.vdata[i]);
+        	if (rit != replacements.end())
+        	{
+        		polygons.vdata[i] = rit->second.first;
+        		polygons.offset[i] = polygons.offset[i] + rit->second.second;
         	}
 
-        	// Rotate entire gerber image as specified by IR parameter
-        	it->offset.rotate(imageRotate);
+        	if (polygons.vdata[i]->empty())
+        		continue;
 
-        	it->initialise();		// Initialise to calculate  raster x1,x2 data.
+        	polygons.vdata[k] = polygons.vdata[i];
+        	polygons.offset[k] = polygons.offset[i];
+        	polygons.polarity[k] = polygons.polarity[i];
+        	polygons.initialise(k);		// Initialise to calculate  raster x1,x2 data.
 
-        	// Identify each polygon with a drawing order number.
-        	// This member is used to plot polygons in the order specified in gerber file.
-        	it->number = k;
+        	if (polygons.polarity[k] != lastPolarity)
+        	{
+        		polarityRunCount++;
+        		runFlashes.clear();
+        	}
+        	polygons.run[k] = polarityRunCount - 1;
+        	lastPolarity = polygons.polarity[k];
         	k++;
-        	it++;
         }
+        polygons.resize(k);
+        flashes.resize(kf);
 
-        if (polygons.size() == 0)
+        if (polygons.size() == 0 && flashes.size() == 0)
 			warning("nothing to draw");
 
-        // Sort all polygons object so they have ascending miny values.
+        // Sort all polygons and flashes so they have ascending miny values.
      	polygons.sort();
+     	flashes.sort();
 
     }
 	catch (const string& msg)
@@ -752,6 +1533,8 @@ Gerber::Gerber(FILE * fp_gerb, const double dotsPerInch, const double growSize,
     	isError = true;
     	errorMessage << "error: " << msg << ". stopped at line " << currentLine;
 	}
+	vertexStatistics = VertexData::statistics();
+	vertexStatistics -= startStatistics;
 }
 
 
@@ -27,6 +27,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <complex>
 #include <vector>
 #include <list>
+#include <map>
+#include <unordered_map>
 #include <math.h>
 #include <ctype.h>
 #include <getopt.h>
@@ -61,8 +63,9 @@ typedef struct T_Arc
 } Arc;
 
 
-extern char *yytext;
 extern void yyrestart( FILE *new_file );
+extern struct yy_buffer_state * yy_scan_bytes( const char *bytes, size_t len );
+extern int yylex_destroy();
 
 
 class Gerber {
@@ -74,6 +77,7 @@ class Gerber {
 		enum APETURE_DRAWING_MODE {CIRCLE_CLOCKWISE, CIRCLE_ANTICLOCKWISE, LINEAR_10X, LINEAR_1X, LINEAR_01X, LINEAR_001X, CIRCULAR360, _INVALID_};
 		typedef enum {MILLIMETER, INCH, UNDEFINED} Units_t ;
 
+		NodeT * standardParameters[5];	// $1 to $5 variable nodes of the standard apertures, shared by all loadDefaults() calls
 		ostringstream oss;
 		const double optScaleY;
 		const double optScaleX;
@@ -96,7 +100,7 @@ class Gerber {
 		bool isCircular360;
 		bool isPolygonFill;
 		bool isLampOn;
-		std::list<Aperture>::iterator lastDrawnApertureSelect;
+		int lastDrawnApertureSelect;
 		double lastDrawnX;
 		double lastDrawnY;
 		double imageRotate;
@@ -105,7 +109,7 @@ class Gerber {
 		int warningCount;
 		bool isWarnNoApertureSelect;
 
-		std::list<Aperture>::iterator apertureSelect;
+		int apertureSelect;				// index in #apertures of the selected aperture
 
 		std::vector< NodeT * > 	temporaryParameters;
 		string 					temporaryNameMacro;
@@ -121,24 +125,79 @@ class Gerber {
 		double dotsPerUnit();
 		const char * unitText()	{	switch (units) { case MILLIMETER: return "mm"; case INCH: return "\""; }	}
 		double getCoordinate( char * const text, int axisNumber, bool alwaysAbsolute = false);
+		double decodeCoordinate( long long value, int digits, int axisNumber, bool alwaysAbsolute);
+
+		// Pixel scale of the coordinate data for the current FS, MO and IO parameters. Made again on first use
+		// after any parameter block or M02.
+		struct CoordinateDecoder
+		{
+			enum { MAX_DIGITS = 16 };
+			bool isValid;
+			int maxDigits[2];					// digits allowed by the FS parameter
+			double scale[2][MAX_DIGITS + 1];	// pixels per unit of the coordinate integer, by number of digits
+			double offset[2];					// image offset in pixels
+		} coordinateDecoder;
+		void specialiseCoordinateDecoder();
 		void calculateArc(Arc &arc);
 		void process_AD_block(int DCode);
 		void process_D_command(int code);
 		void process_G_command(int code);
 		void processDataBlock();
 		void flashAperture(double x, double y);
+		Point pixelOffset(const Point &p, Point &fraction);
+		bool addTracePolygon(const vector<long> &shape, const Point &start, bool isClear, Point &fraction);
+		double roundTraceWidth(const Aperture &ap);
+		double rectangleTraceHeight(const Aperture &ap);
+		void addTrace(const Aperture &ap, const Point &start, const Point &end, bool isClear);
+
+        // Consecutive joined traces of the same round or rectangle aperture, drawn as one polygon when the chain ends
+        struct TraceStroke
+        {
+        	int aperture;				// index in #apertures
+        	bool isClear;
+        	vector<Point> points;		// tool positions, before scaling
+        	double scale[2];			// scale factor of the traces, which a later SF or MI parameter may change
+        } stroke;
+        void addStrokeSegment();
+        void flushStroke();
+		map< vector<long>, VertexData *> traceShapes;	// vertex data of trace polygons, keyed by shape and start pixel fraction in 1/256 pixel units
 		void loadDefaults();
-        std::list< Aperture > macro_apertures;
-        std::list< Aperture > ad_apertures;
+		void shareVertexData(map<VertexData *, pair<VertexData *, Point> > &replacements);
+		void moveOffsetsToVertices();
+        unordered_map< string, vector<Aperture> > macros;		// primitives of each aperture macro, by name
+        vector<Aperture> apertures;					// apertures defined by AD blocks, the first is the default aperture
+        enum { MAX_TABLE_DCODE = 100000 };
+        vector<int> dcodeTable;						// index in #apertures of each D code below MAX_TABLE_DCODE, or -1
+        map<int, int> largeDCodes;					// the same for higher D codes
+        int findAperture(int DCode);
 
         struct StepRpeatBlock
         {
-        	string buffer;
+        	size_t firstPolygon;		// index in #polygons of the first polygon of the block
+        	size_t firstFlash;			// index in #flashes of the first flash of the block
         	int X;
         	int Y;
-        	double I;
+        	double I;					// step distance in pixels
         	double J;
         } repeat;
+        void beginStepRepeat(int x, int y, double i, double j);
+        void endStepRepeat();
+
+        // A command of a data block read by the memory mapped scanner
+        struct BlockToken
+        {
+        	char code;					// X, Y, I, J, D, G or M, or C for a G04 comment
+        	long long value;
+        	int digits;					// number of digits of the value, without sign
+        	int lines;					// line feeds before the command
+        };
+        vector<BlockToken> blockTokens;
+        int blockLines;					// line feeds after the last command of the block
+        bool parseMappedFile(FILE *fp);
+        void scanMapped(const char *p, const char *end);
+        bool tokeniseDataBlock(const char *p, const char *end);
+        bool runDataBlock();
+        void parseText(const char *p, const char *end);
 
 
 	public: //---------------------------
@@ -151,14 +210,36 @@ class Gerber {
 		std::ostringstream errorMessage;			// string of occurring error
 		bool isError;
 
-		list<Polygon> polygons;		// Contains a complete polygons list to build an image of this gerber file.
-		list<VertexData *> vertexdata;	// Vertices information used by each new polygon requiring a new set of vertices.
+		// All macro expression nodes and vertex data created for this file. Freed when the Gerber object is deleted.
+		Arena<NodeT> nodeArena;
+		Arena<VertexData> vertexArena;
 
-		Gerber(FILE * fp_gerb, double ImageDPI, double GrowSize, double optScaleX, double optScaleY);
+		PolygonStore polygons;		// Contains a complete polygons list to build an image of this gerber file.
+		FlashStore flashes;			// Flashed apertures, drawn in the order given by their polarity run like the polygons.
+		vector<ShapeGroup> shapeGroups;	// Polygons of each flashed aperture
+		list<VertexData *> vertexdata;	// Vertices information used by each new polygon requiring a new set of vertices.
+		int sharedVertexDataCount;		// number of vertex sets replaced by an identical set at another position
+		int traceShapeCount;			// number of trace polygons created
+		int traceShapeSharedCount;		// number of trace polygons that reused the vertex data of an earlier trace
+		int polarityRunCount;			// number of polarity runs in #polygons and #flashes
+		int redundantFlashCount;		// number of flashes left out as duplicates or covered by their trace
+		int strokeCount;				// number of polygons made from chains of traces
+		int strokeSegmentCount;			// number of traces in these chains
+		static bool isFastLexerEnabled;	// read regular files through the memory mapped scanner
+		static ApertureCache apertureCache;	// apertures rendered for all files
+		int fastDataBlockCount;			// data blocks decoded by the memory mapped scanner
+		int fastParameterBlockCount;	// parameter blocks it passed to the flex scanner and parser
+		bool isFastLexerFallback;		// the memory mapped scanner passed the rest of the file to flex
+		unsigned long coordinateCount;	// number of X, Y, I and J coordinates decoded
+		double parseSeconds;			// processor time spent reading the file
+		VertexStatistics vertexStatistics;	// arcs and simplified outlines made for the file
+
+		Gerber(FILE * fp_gerb, double ImageDPI, double GrowSize, double optScaleX, double optScaleY, double optRotation = 0,
+				bool optMirrorX = false, bool optMirrorY = false);
 };
 
 
-extern void yyerror( Gerber *g, const char * msg);
+extern void yyerror( const char * msg, int token);
 
 
 
@@ -1,22 +1,22 @@
-/* A Bison parser, made by GNU Bison 2.4.2.  */
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison interface for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
 
-/* Skeleton interface for Bison's Yacc-like parsers in C
-   
-      Copyright (C) 1984, 1989-1990, 2000-2006, 2009-2010 Free Software
-   Foundation, Inc.
-   
    This program is free software: you can redistribute it and/or modify
    it under the terms of the GNU General Public License as published by
    the Free Software Foundation, either version 3 of the License, or
    (at your option) any later version.
-   
+
    This program is distributed in the hope that it will be useful,
    but WITHOUT ANY WARRANTY; without even the implied warranty of
    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
    GNU General Public License for more details.
-   
+
    You should have received a copy of the GNU General Public License
-   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
 
 /* As a special exception, you may create a larger work that contains
    part or all of the Bison parser skeleton and distribute that work
@@ -27,64 +27,75 @@
    special exception, which will cause the skeleton and the resulting
    Bison output files to be licensed under the GNU General Public
    License without this special exception.
-   
+
    This special exception was added by the Free Software Foundation in
    version 2.2 of Bison.  */
 
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
 
-/* Tokens.  */
+#ifndef YY_YY_SRC_GERBER_BISON_H_INCLUDED
+# define YY_YY_SRC_GERBER_BISON_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int yydebug;
+#endif
+
+/* Token kinds.  */
 #ifndef YYTOKENTYPE
 # define YYTOKENTYPE
-   /* Put the tokens into the symbol table, so that GDB and other debuggers
-      know about them.  */
-   enum yytokentype {
-     PARAMETER_ADD = 258,
-     PARAMETER_AM = 259,
-     PARAMETER = 260,
-     NUMBER = 261,
-     VARIABLE = 262,
-     CODE = 263,
-     SYMBOL_X = 264,
-     MACRONAME = 265,
-     UNARY = 266
-   };
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    PARAMETER_ADD = 258,           /* PARAMETER_ADD  */
+    PARAMETER_AM = 259,            /* PARAMETER_AM  */
+    PARAMETER = 260,               /* PARAMETER  */
+    NUMBER = 261,                  /* NUMBER  */
+    VARIABLE = 262,                /* VARIABLE  */
+    CODE = 263,                    /* CODE  */
+    SYMBOL_X = 264,                /* SYMBOL_X  */
+    MACRONAME = 265,               /* MACRONAME  */
+    UNARY = 266                    /* UNARY  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
 #endif
-/* Tokens.  */
-#define PARAMETER_ADD 258
-#define PARAMETER_AM 259
-#define PARAMETER 260
-#define NUMBER 261
-#define VARIABLE 262
-#define CODE 263
-#define SYMBOL_X 264
-#define MACRONAME 265
-#define UNARY 266
-
-
-
 
+/* Value type.  */
 #if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
-typedef union YYSTYPE
+union YYSTYPE
 {
-
-/* Line 1685 of yacc.c  */
 #line 11 "src/gerber_bison.yy"
+
+	char * YS_string;
+	double 	YS_float;
+	int 	YS_int;
+	NodeT	*YS_NodeT;
 
-	char * YS_string;
-	double 	YS_float;
-	int 	YS_int;
-	NodeT	*YS_NodeT;
-
-
-
-/* Line 1685 of yacc.c  */
 #line 82 "src/gerber_bison.h"
-} YYSTYPE;
+
+};
+typedef union YYSTYPE YYSTYPE;
 # define YYSTYPE_IS_TRIVIAL 1
-# define yystype YYSTYPE /* obsolescent; will be withdrawn */
 # define YYSTYPE_IS_DECLARED 1
 #endif
 
-extern YYSTYPE yylval;
 
 
+
+int yyparse (Gerber *g);
+
+/* "%code provides" blocks.  */
+#line 27 "src/gerber_bison.yy"
+
+extern YYSTYPE yylval;				// value of the last token of the flex scanner
+
+#line 100 "src/gerber_bison.h"
+
+#endif /* !YY_YY_SRC_GERBER_BISON_H_INCLUDED  */
@@ -17,11 +17,33 @@
 
 
 %defines
+%define api.pure full
 %parse-param {Gerber *g}
 %lex-param {Gerber *g}
 %error-verbose
 %token-table
 
+%code provides
+{
+extern YYSTYPE yylval;				// value of the last token of the flex scanner
+}
+
+%code
+{
+// The parser keeps its state on the stack so that files can be parsed on several threads. The scanner made by
+// flex is not reentrant; it is used only while the scanner mutex in gerber.cpp is held, and the value of each
+// token it returns is copied from yylval.
+static int yylex(YYSTYPE *value, Gerber *g)
+{
+	int token = yylex(g);
+	*value = yylval;
+	return token;
+}
+
+// Syntax errors name the lookahead token of the parser instead of the text of the scanner.
+#define yyerror(g, message)	yyerror(message, yychar)
+}
+
 %token <YS_int> PARAMETER_ADD
 %token PARAMETER_AM
 %token PARAMETER
@@ -43,7 +65,7 @@
 gerber 				: 	data_block
 					| 	gerber data_block
 
-data_block 			:	'%' paramRS274_list '%'
+data_block 			:	'%' paramRS274_list '%'	{ g->coordinateDecoder.isValid = false; }		// FS, MO or IO may have changed
 				  	|	'%' PARAMETER_AM  MACRONAME am_primitive_list  asterisk  '%'
 					|	command_list '*' { g->processDataBlock(); }						// Always process data block immediately after first asterisk
 					| 	'*'																// Allow empty data blocks
@@ -58,6 +80,7 @@ paramRS274_list		:	paramRS274 asterisk
 paramRS274 			:	PARAMETER
 					|	PARAMETER_ADD MACRONAME ',' ad_modifier_list { g->process_AD_block($1);  }
 					|	PARAMETER_ADD MACRONAME { g->process_AD_block($1);  }
+					|	'S' 'R'		{ g->endStepRepeat(); }									// SR without modifiers ends a step and repeat block
 
 ad_modifier_list 	:	ad_number						{ g->variables.push_back($1); }
 					|	ad_modifier_list 'X' ad_number	{ g->variables.push_back($3); }
@@ -72,24 +95,25 @@ am_primitive_list	: 	asterisk am_primitve
 
 am_primitve			: 	NUMBER ',' expr_list
 					{
-						g->macro_apertures.push_back(Aperture());
-						g->macro_apertures.back().primitive = Aperture::PRIMITIVE( int($1) );
-						g->macro_apertures.back().parameter = g->temporaryParameters;
-						g->macro_apertures.back().nameMacro = g->temporaryNameMacro;
-						g->macro_apertures.back().linenum_at_definition = g->currentLine;
+						vector<Aperture> &macro = g->macros[g->temporaryNameMacro];
+						macro.push_back(Aperture());
+						macro.back().primitive = Aperture::PRIMITIVE( int($1) );
+						macro.back().parameters.compile(g->temporaryParameters, g->variables);
+						macro.back().nameMacro = g->temporaryNameMacro;
+						macro.back().linenum_at_definition = g->currentLine;
 						g->temporaryParameters.clear();
 					}
 
 expr_list 			:  	expr				{ g->temporaryParameters.push_back($1); }
 					|  	expr_list ',' expr	{ g->temporaryParameters.push_back($3); }
 
-expr				: 	VARIABLE  	{ $$ = new NodeT(NodeT::VAR		, &$1, &g->variables); }
-					| 	NUMBER		{ $$ = new NodeT(NodeT::CONSTANT, &$1); }
-					| 	expr '+' expr	{ $$ = new NodeT(NodeT::OPADD	, $1, $3); }
-					| 	expr '-' expr	{ $$ = new NodeT(NodeT::OPSUB	, $1, $3); }
-					| 	expr 'X' expr	{ $$ = new NodeT(NodeT::OPMUL	, $1, $3); }
-					| 	expr '/' expr	{ $$ = new NodeT(NodeT::OPDIV	, $1, $3); }
-					| 	'-' expr 	%prec UNARY	{ $$ = new NodeT(NodeT::OPNEG, $2); }
+expr				: 	VARIABLE  	{ $$ = new (g->nodeArena) NodeT(NodeT::VAR		, &$1); }
+					| 	NUMBER		{ $$ = new (g->nodeArena) NodeT(NodeT::CONSTANT, &$1); }
+					| 	expr '+' expr	{ $$ = new (g->nodeArena) NodeT(NodeT::OPADD	, $1, $3); }
+					| 	expr '-' expr	{ $$ = new (g->nodeArena) NodeT(NodeT::OPSUB	, $1, $3); }
+					| 	expr 'X' expr	{ $$ = new (g->nodeArena) NodeT(NodeT::OPMUL	, $1, $3); }
+					| 	expr '/' expr	{ $$ = new (g->nodeArena) NodeT(NodeT::OPDIV	, $1, $3); }
+					| 	'-' expr 	%prec UNARY	{ $$ = new (g->nodeArena) NodeT(NodeT::OPNEG, $2); }
 					| 	'+' expr 	%prec UNARY	{ $$ = $2; }
 					| 	'(' expr ')'	{ $$ = $2; }
 
@@ -106,3 +130,4 @@ asterisk			: 	'*'									// allow an asterisk can be one or more consecutive '*
 
 %%
 
+YYSTYPE yylval;
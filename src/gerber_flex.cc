@@ -634,12 +634,6 @@ char *yytext;
 
 #define YY_DECL 	int yylex(Gerber *g)
 
-#define YY_USER_ACTION  \
-	if (g->repeat.X > 1 && g->repeat.Y > 1) \
-	{ \
-		g->repeat.buffer += yytext; \
-	}
-
 /*  
  *
  *
@@ -894,7 +888,7 @@ YY_DECL
 		}
 
 	{
-#line 53 "src/gerber_flex.ll"
+#line 47 "src/gerber_flex.ll"
 
 #line 899 "src/gerber_flex.cc"
 
@@ -955,19 +949,19 @@ do_action:	/* This label is used only to access EOF actions. */
 
 case 1:
 YY_RULE_SETUP
-#line 54 "src/gerber_flex.ll"
+#line 48 "src/gerber_flex.ll"
 { }										// root out all white spaces, CR
 	YY_BREAK
 case 2:
 /* rule 2 can match eol */
 YY_RULE_SETUP
-#line 55 "src/gerber_flex.ll"
+#line 49 "src/gerber_flex.ll"
 {	g->currentLine++;					// count the LF and hide from parser
 							}
 	YY_BREAK
 case 3:
 YY_RULE_SETUP
-#line 57 "src/gerber_flex.ll"
+#line 51 "src/gerber_flex.ll"
 {				// get floating point number, and extract extranous '.' followed by digits.
 								yylval.YS_float   = atof(yytext);	// Evaluate number but ignore '+' or '-' prefix as it handler in yylex()
 								if (strchr(yytext,'.') != strrchr(yytext,'.') )  g->warning("extraneous '.' in number");
@@ -976,7 +970,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 4:
 YY_RULE_SETUP
-#line 62 "src/gerber_flex.ll"
+#line 56 "src/gerber_flex.ll"
 {
 								yylval.YS_int  = atoi(yytext+1)-1;		// $n Variables identifiers
 								if (yylval.YS_int < 0 ) throw string("variable placeholder must be >= 1");
@@ -985,7 +979,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 5:
 YY_RULE_SETUP
-#line 67 "src/gerber_flex.ll"
+#line 61 "src/gerber_flex.ll"
 {	yy_push_state(macroname);				// AM paramater syntax
 								BEGIN(AMblock);							// goto <AMblock> condition, exits on next '%' tocken, see below
 								yy_push_state(macroname);
@@ -994,7 +988,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 6:
 YY_RULE_SETUP
-#line 72 "src/gerber_flex.ll"
+#line 66 "src/gerber_flex.ll"
 {	yylval.YS_int = atoi(yytext+3);		// ADD paramater syntax (return D code in value)
 								BEGIN(ADblock);					// goto <ADblock> condition, exits on next '*' tocken, see below
 								yy_push_state(macroname);
@@ -1003,7 +997,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 7:
 YY_RULE_SETUP
-#line 77 "src/gerber_flex.ll"
+#line 71 "src/gerber_flex.ll"
 {								// a string of the Aperture macro name
 								g->temporaryNameMacro = yytext;				// save string
 								yy_pop_state();
@@ -1012,7 +1006,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 8:
 YY_RULE_SETUP
-#line 82 "src/gerber_flex.ll"
+#line 76 "src/gerber_flex.ll"
 {  							// FS Format Statement
 								(strchr( yytext,'L') == 0 ) ? g->isOmitLeadingZeroes = false : g->isOmitLeadingZeroes = true;
 								(strchr( yytext,'A') == 0 ) ? g->isCoordsAbsolute = false : g->isCoordsAbsolute = true;
@@ -1026,7 +1020,7 @@ YY_RULE_SETUP
 case 9:
 /* rule 9 can match eol */
 YY_RULE_SETUP
-#line 91 "src/gerber_flex.ll"
+#line 85 "src/gerber_flex.ll"
 {															// IF, Include file.  Don't return to parser
 								yytext[yyleng-1]=0;			// remove trailing '*'
 								yyin = fopen(yytext+2,"r");
@@ -1037,17 +1031,17 @@ YY_RULE_SETUP
 case 10:
 /* rule 10 can match eol */
 YY_RULE_SETUP
-#line 97 "src/gerber_flex.ll"
+#line 91 "src/gerber_flex.ll"
 {	return CODE; }											// G04 command. Skip remainder of data block.
 	YY_BREAK
 case 11:
 YY_RULE_SETUP
-#line 98 "src/gerber_flex.ll"
+#line 92 "src/gerber_flex.ll"
 {	g->isAxisSwapped = false; return PARAMETER; }			// Axis Swap
 	YY_BREAK
 case 12:
 YY_RULE_SETUP
-#line 99 "src/gerber_flex.ll"
+#line 93 "src/gerber_flex.ll"
 {	g->isAxisSwapped = true;
 								g->warning("Ignoring AS (Axis Swap) parameter. A axis = X data, B axis = Y data.");
 								return PARAMETER;
@@ -1055,66 +1049,60 @@ YY_RULE_SETUP
 	YY_BREAK
 case 13:
 YY_RULE_SETUP
-#line 103 "src/gerber_flex.ll"
-{
-//							cout << "\nlast SR block "<<g->repeat.buffer<<"\n";
-							g->repeat.I = 0;
-							g->repeat.J = 0;
-							double x=1,y=1;
+#line 97 "src/gerber_flex.ll"
+{										// Step and Repeat. Ends the previous SR block and starts a new one.
+							double x=1,y=1,i=0,j=0;
 							numberAfterChar(yytext, 'X', &x);
 							numberAfterChar(yytext, 'Y', &y);
-							g->repeat.X = int(x);
-							g->repeat.Y = int(y);
-							numberAfterChar(yytext, 'I', &g->repeat.I);
-							numberAfterChar(yytext, 'J', &g->repeat.J);
-							g->repeat.buffer.erase();
-							g->warning("Ignoring SR (Step and Repeat) parameter");
+							numberAfterChar(yytext, 'I', &i, g->dotsPerUnit() );
+							numberAfterChar(yytext, 'J', &j, g->dotsPerUnit() );
+							g->beginStepRepeat(int(x), int(y), i, j);
 							return PARAMETER;
 							}
 	YY_BREAK
 case 14:
 YY_RULE_SETUP
-#line 119 "src/gerber_flex.ll"
+#line 107 "src/gerber_flex.ll"
 {	return PARAMETER; 	}									// ignores empty AD parameter blocks
 	YY_BREAK
 case 15:
 YY_RULE_SETUP
-#line 120 "src/gerber_flex.ll"
+#line 108 "src/gerber_flex.ll"
 {	throw string(yytext)+" KO Knockout parameter not supported";  }	// Reason is becuase the standard does not define KO properly
 	YY_BREAK
 case 16:
 YY_RULE_SETUP
-#line 121 "src/gerber_flex.ll"
+#line 109 "src/gerber_flex.ll"
 { 	g->layerPolarityClear = false;  return PARAMETER; }		// Layer Polarity (draw dark)
 	YY_BREAK
 case 17:
 YY_RULE_SETUP
-#line 122 "src/gerber_flex.ll"
+#line 110 "src/gerber_flex.ll"
 { 	g->layerPolarityClear = true; return PARAMETER; }		// Layer Polarity (draw clear)
 	YY_BREAK
 case 18:
 YY_RULE_SETUP
-#line 123 "src/gerber_flex.ll"
+#line 111 "src/gerber_flex.ll"
 {	g->imagePolarityDark = true; return PARAMETER; }		// Image Polarity set to dark
 	YY_BREAK
 case 19:
 YY_RULE_SETUP
-#line 124 "src/gerber_flex.ll"
+#line 112 "src/gerber_flex.ll"
 {	g->imagePolarityDark = false; return PARAMETER; }		// Image Polarity set to clear
 	YY_BREAK
 case 20:
 YY_RULE_SETUP
-#line 125 "src/gerber_flex.ll"
+#line 113 "src/gerber_flex.ll"
 { 	g->units = Gerber::INCH;  return PARAMETER; }  					// assign dimensions in inches 
 	YY_BREAK
 case 21:
 YY_RULE_SETUP
-#line 126 "src/gerber_flex.ll"
+#line 114 "src/gerber_flex.ll"
 { 	g->units = Gerber::MILLIMETER; return PARAMETER; }				// assign dimensions in millimetres
 	YY_BREAK
 case 22:
 YY_RULE_SETUP
-#line 127 "src/gerber_flex.ll"
+#line 115 "src/gerber_flex.ll"
 {	bool preA = g->isMirrorAaxis;							// specify mirroring of A axis and/or B axis
 								bool preB = g->isMirrorBaxis;
 								if (strstr(yytext, "A0") != 0) g->isMirrorAaxis = false;
@@ -1128,9 +1116,9 @@ YY_RULE_SETUP
 	YY_BREAK
 case 23:
 YY_RULE_SETUP
-#line 137 "src/gerber_flex.ll"
+#line 125 "src/gerber_flex.ll"
 {   int i = atoi(yytext+1);
-								if (i == 2 ) { 	g->loadDefaults(); return '*'; }		// M2 reset Gerber parameters and continue reading
+								if (i == 2 ) { 	g->endStepRepeat(); g->loadDefaults(); return '*'; }		// M2 reset Gerber parameters and continue reading
 								if (i == 3 ) return 0;									// M3 stop reading program
 								if (i <= 1 ) return '*';								// M0 / M1 just ignore, and continue reading as normal
 								throw "Unknown "+string(yytext)+" code";
@@ -1138,27 +1126,27 @@ YY_RULE_SETUP
 	YY_BREAK
 case 24:
 YY_RULE_SETUP
-#line 143 "src/gerber_flex.ll"
+#line 131 "src/gerber_flex.ll"
 {  	g->X = g->getCoordinate(yytext+1, 0); return CODE; }
 	YY_BREAK
 case 25:
 YY_RULE_SETUP
-#line 144 "src/gerber_flex.ll"
+#line 132 "src/gerber_flex.ll"
 {  	g->Y = g->getCoordinate(yytext+1, 1); return CODE; }
 	YY_BREAK
 case 26:
 YY_RULE_SETUP
-#line 145 "src/gerber_flex.ll"
+#line 133 "src/gerber_flex.ll"
 {  	g->I = g->getCoordinate(yytext+1, 0, true); return CODE; }
 	YY_BREAK
 case 27:
 YY_RULE_SETUP
-#line 146 "src/gerber_flex.ll"
+#line 134 "src/gerber_flex.ll"
 {  	g->J = g->getCoordinate(yytext+1, 1, true); return CODE; }
 	YY_BREAK
 case 28:
 YY_RULE_SETUP
-#line 147 "src/gerber_flex.ll"
+#line 135 "src/gerber_flex.ll"
 {														// Image Offset (treat OF and IO synonymously as RS273X Standard doesn't define)
 								numberAfterChar(yytext, 'A', &g->imageOffsetPixels[0], g->dotsPerUnit() );
 								numberAfterChar(yytext, 'B', &g->imageOffsetPixels[1], g->dotsPerUnit() );
@@ -1167,7 +1155,7 @@ YY_RULE_SETUP
 	YY_BREAK
 case 29:
 YY_RULE_SETUP
-#line 152 "src/gerber_flex.ll"
+#line 140 "src/gerber_flex.ll"
 {														// Scale Factor
 								numberAfterChar(yytext, 'A', &g->scaleFactor[0], g->optScaleX * (g->isMirrorAaxis ? -1 : 1) );
 								numberAfterChar(yytext, 'B', &g->scaleFactor[1], g->optScaleY * (g->isMirrorBaxis ? -1 : 1) );
@@ -1176,58 +1164,58 @@ YY_RULE_SETUP
 	YY_BREAK
 case 30:
 YY_RULE_SETUP
-#line 158 "src/gerber_flex.ll"
+#line 146 "src/gerber_flex.ll"
 {	g->imageRotate = -atof(yytext+2)*M_PI/180.0; return PARAMETER; }	// Image Rotate about origin in degreese
 	YY_BREAK
 case 31:
 /* rule 31 can match eol */
 YY_RULE_SETUP
-#line 159 "src/gerber_flex.ll"
+#line 147 "src/gerber_flex.ll"
 {	g->layerName = yytext[2]; return PARAMETER; 	}		// Layer Name
 	YY_BREAK
 case 32:
 /* rule 32 can match eol */
 YY_RULE_SETUP
-#line 160 "src/gerber_flex.ll"
+#line 148 "src/gerber_flex.ll"
 {	g->imageName = yytext[2]; return PARAMETER; 	}		// Image Name
 	YY_BREAK
 case 33:
 /* rule 33 can match eol */
 YY_RULE_SETUP
-#line 161 "src/gerber_flex.ll"
+#line 149 "src/gerber_flex.ll"
 {	g->imageFilm = yytext[2]; return PARAMETER; 	}		// Image Film string for the operator 
 	YY_BREAK
 case 34:
 /* rule 34 can match eol */
 YY_RULE_SETUP
-#line 162 "src/gerber_flex.ll"
+#line 150 "src/gerber_flex.ll"
 {	g->warning("ignoring parameter '%c%c'",yytext[0],yytext[1]); return PARAMETER; 	}									// safely ignore all these parameters
 	YY_BREAK
 case 35:
 YY_RULE_SETUP
-#line 163 "src/gerber_flex.ll"
+#line 151 "src/gerber_flex.ll"
 {	BEGIN(0); return yytext[0]; }							// '%' causes to exit AM blocks (note: '*' does not and must not end AM blocks)
 	YY_BREAK
 case 36:
 YY_RULE_SETUP
-#line 164 "src/gerber_flex.ll"
+#line 152 "src/gerber_flex.ll"
 {	BEGIN(0); return yytext[0]; }							// '*' causes to exit AD blocks (possible subsequent AD blocks before '%')
 	YY_BREAK
 case 37:
 YY_RULE_SETUP
-#line 165 "src/gerber_flex.ll"
+#line 153 "src/gerber_flex.ll"
 {	return toupper(yytext[0]); }							// return all other valid single characters
 	YY_BREAK
 case 38:
 YY_RULE_SETUP
-#line 166 "src/gerber_flex.ll"
+#line 154 "src/gerber_flex.ll"
 { }															// ignore all invalid characters
 	YY_BREAK
 case YY_STATE_EOF(INITIAL):
 case YY_STATE_EOF(ADblock):
 case YY_STATE_EOF(AMblock):
 case YY_STATE_EOF(macroname):
-#line 167 "src/gerber_flex.ll"
+#line 155 "src/gerber_flex.ll"
 {
 								yypop_buffer_state();
 								if ( !YY_CURRENT_BUFFER )
@@ -1238,7 +1226,7 @@ case YY_STATE_EOF(macroname):
 	YY_BREAK
 case 39:
 YY_RULE_SETUP
-#line 175 "src/gerber_flex.ll"
+#line 163 "src/gerber_flex.ll"
 ECHO;
 	YY_BREAK
 #line 1244 "src/gerber_flex.cc"
@@ -2290,7 +2278,7 @@ void yyfree (void * ptr )
 
 #define YYTABLES_NAME "yytables"
 
-#line 175 "src/gerber_flex.ll"
+#line 163 "src/gerber_flex.ll"
 
 
 
@@ -10,12 +10,6 @@
 
 #define YY_DECL 	int yylex(Gerber *g)
 
-#define YY_USER_ACTION  \
-	if (g->repeat.X > 1 && g->repeat.Y > 1) \
-	{ \
-		g->repeat.buffer += yytext; \
-	}
-
 /*  
  *
  *
@@ -100,19 +94,13 @@ ASAYBX						{	g->isAxisSwapped = true;
 								g->warning("Ignoring AS (Axis Swap) parameter. A axis = X data, B axis = Y data.");
 								return PARAMETER;
 							}
-SR([XYIJ][-+]?[0-9]*\.?[0-9]+)+ 	{
-//							cout << "\nlast SR block "<<g->repeat.buffer<<"\n";
-							g->repeat.I = 0;
-							g->repeat.J = 0;
-							double x=1,y=1;
+SR([XYIJ][-+]?[0-9]*\.?[0-9]+)+ 	{										// Step and Repeat. Ends the previous SR block and starts a new one.
+							double x=1,y=1,i=0,j=0;
 							numberAfterChar(yytext, 'X', &x);
 							numberAfterChar(yytext, 'Y', &y);
-							g->repeat.X = int(x);
-							g->repeat.Y = int(y);
-							numberAfterChar(yytext, 'I', &g->repeat.I);
-							numberAfterChar(yytext, 'J', &g->repeat.J);
-							g->repeat.buffer.erase();
-							g->warning("Ignoring SR (Step and Repeat) parameter");
+							numberAfterChar(yytext, 'I', &i, g->dotsPerUnit() );
+							numberAfterChar(yytext, 'J', &j, g->dotsPerUnit() );
+							g->beginStepRepeat(int(x), int(y), i, j);
 							return PARAMETER;
 							}
 
@@ -135,7 +123,7 @@ MI(A[01])?(B[01])?			{	bool preA = g->isMirrorAaxis;							// specify mirroring
 								return PARAMETER;
 							}
 M[0-9]+						{   int i = atoi(yytext+1);
-								if (i == 2 ) { 	g->loadDefaults(); return '*'; }		// M2 reset Gerber parameters and continue reading
+								if (i == 2 ) { 	g->endStepRepeat(); g->loadDefaults(); return '*'; }		// M2 reset Gerber parameters and continue reading
 								if (i == 3 ) return 0;									// M3 stop reading program
 								if (i <= 1 ) return '*';								// M0 / M1 just ignore, and continue reading as normal
 								throw "Unknown "+string(yytext)+" code";
@@ -29,6 +29,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <vector>
 #include <list>
 #include <map>
+#include <queue>
 #include <string>
 #include <math.h>
 #include <limits.h>
@@ -37,6 +38,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <tiffio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
 #include <config.h>
 
 using namespace std;
@@ -79,6 +81,27 @@ const char *help_message=
 "  --strip-rows=N       Specify N rows per strip in TIFF. Default 512\n"
 "  --scale-y=FACTOR     Scale image in Y axis by FACTOR. Default 1\n"
 "  --scale-x=FACTOR     Scale image in X axis by FACTOR. Default 1\n"
+"  --rotation=DEG       Rotate image anticlockwise by DEG degrees. Default 0\n"
+"  --mirror-x           Mirror the image left to right, after any rotation\n"
+"  --mirror-y           Mirror the image top to bottom, after any rotation\n"
+"  --arc-tolerance=X    Maximum deviation in pixels of arcs approximated by\n"
+"                       straight lines. Must be < 0.5. Default 0.01\n"
+"  --arc-tolerance-um=X Same as --arc-tolerance except X is in micrometers.\n"
+"  --panel=NxM,PX,PY    Draw the image as a panel of N columns and M rows, with\n"
+"                       a pitch of PX and PY millimeters.\n"
+"  --simplify=X         Remove region (G36) outline vertices that are within X\n"
+"                       pixels of the simplified outline. Must be < 0.5\n"
+"  --fast-lexer         Read gerber files through a memory mapped scanner that\n"
+"                       decodes data blocks without flex. Always used when\n"
+"                       more than one file is read at a time.\n"
+"  --cache-dir=DIR      Keep the scan tables of apertures in directory DIR to\n"
+"                       be reused by later runs.\n"
+"  --cache-size=MB      Size limit of the --cache-dir files. Default 256\n"
+"  --save-geometry=FILE Save the geometry of the gerber files to FILE.\n"
+"  --load-geometry=FILE Draw the geometry saved in FILE instead of reading\n"
+"                       gerber files. Requires the same image options.\n"
+"  --threads=N          Read up to N gerber files at the same time.\n"
+"                       Default is the number of processors.\n"
 "\n"
 "Where file1 file2... are gerber files rendered as overlays to a single bitmap.\n"
 "Standard input is read if no gerber files specified and --output is specified.\n"
@@ -109,7 +132,9 @@ void error(const string &message)
 // Global variables of plotting parameters
 //**************************************************
     double imageDPI = 2400;
-    double optRotation;
+    double optRotation = 0;
+    bool   optMirrorX = false;
+    bool   optMirrorY = false;
     bool   optGrowUnitsMillimeters = false;
     bool   optBoarderUnitsMillimeters = false;
     double optBoarder = 0;
@@ -123,6 +148,18 @@ void error(const string &message)
 	double optGrowSize = 0;
 	double optScaleX = 1;
 	double optScaleY = 1;
+	double optArcTolerance = 0.01;
+	bool   optArcToleranceUnitsMicrometers = false;
+	int    optPanelColumns = 1;
+	int    optPanelRows = 1;
+	double optPanelPitchX = 0;			// panel instance pitch, in mm until converted to pixels
+	double optPanelPitchY = 0;
+	double optSimplifyTolerance = 0;	// 0 disables simplification
+	string optCacheDirectory;			// empty for no persistent aperture cache
+	double optCacheSize = 256;			// MB
+	string optSaveGeometry;				// geometry file to write after reading the gerber files
+	string optLoadGeometry;				// geometry file read in place of gerber files
+	int    optThreads = 0;				// threads parsing gerber files, 0 for one per processor
 	unsigned int bytesPerScanline;
 	unsigned int bitmapBytes;
 	unsigned char * bitmap;
@@ -227,6 +264,149 @@ void horizontalLine( int x1, int x2, unsigned char *buffer, Polarity_t polarity)
 
 
 
+//**********************************************************
+// A copy of the image in a panel, drawn at an offset of dx,dy pixels. polyIndex and flashIndex are the next polygon
+// and flash of the sorted lists to become active for this instance.
+//**********************************************************
+struct PanelInstance
+{
+	int dx, dy;
+	int runOffset;
+	size_t polyIndex;
+	size_t flashIndex;
+};
+
+
+// Orders the polygons of flashes waiting to become active with the lowest first row on top.
+struct LaterFirstRow
+{
+	bool operator()( const PolygonReference &a, const PolygonReference &b) const
+	{
+		return a.pixelMinY > b.pixelMinY;
+	}
+};
+
+
+// Keep the active list in polarity run order. A new polygon goes after all others of its run, so for the usual
+// single dark run it is just appended.
+static void insertActive( list<PolygonReference> &activePolys, const PolygonReference &ref)
+{
+	list<PolygonReference>::iterator pos = activePolys.end();
+	while (pos != activePolys.begin())
+	{
+		list<PolygonReference>::iterator before = pos;
+		if ((--before)->run <= ref.run)
+			break;
+		pos = before;
+	}
+	activePolys.insert( pos, ref );
+}
+
+
+
+//**********************************************************
+// Coarse grid over the image holding, for each cell of 64 x 64 pixels, the lowest polarity run of the dark
+// polygons whose bounding box touches the cell. A clear polygon or span can only change the image where a dark
+// polygon of an earlier run has been drawn, so anything clear outside such cells can be skipped.
+//**********************************************************
+class DarkRunGrid
+{
+	enum { SHIFT = 6 };
+	int x0, y0, columns, rows;
+	vector<int> minRun;
+
+	void clip( int &x1, int &y1, int &x2, int &y2) const
+	{
+		x1 = max(0, (x1 - x0) >> SHIFT);
+		y1 = max(0, (y1 - y0) >> SHIFT);
+		x2 = min(columns-1, (x2 - x0) >> SHIFT);
+		y2 = min(rows-1, (y2 - y0) >> SHIFT);
+	}
+
+public:
+	DarkRunGrid( int minx, int miny, int maxx, int maxy)
+		: x0(minx-1), y0(miny-1)
+		 ,columns( ((maxx+1 - x0) >> SHIFT) + 1 )
+		 ,rows( ((maxy+1 - y0) >> SHIFT) + 1 )
+		 ,minRun( columns * rows, INT_MAX)
+	{ }
+
+	void addDark( int x1, int y1, int x2, int y2, int run)
+	{
+		clip(--x1, --y1, ++x2, ++y2);	// one extra pixel for rounding of the scan line data
+		for (int y = y1; y <= y2; y++)
+			for (int x = x1; x <= x2; x++)
+				if (minRun[y*columns + x] > run)
+					minRun[y*columns + x] = run;
+	}
+
+	bool isDarkBefore( int x1, int y1, int x2, int y2, int run) const
+	{
+		if (x1 > x2) swap(x1, x2);
+		clip(x1, y1, x2, y2);
+		for (int y = y1; y <= y2; y++)
+			for (int x = x1; x <= x2; x++)
+				if (minRun[y*columns + x] < run)
+					return true;
+		return false;
+	}
+};
+
+
+
+
+//---------------------------------------------------------------------------------
+// Gerber files parsed by parseFiles(). Each thread takes the next file until none are left, so the
+// Gerber objects are the same, in the same order, whatever the number of threads.
+struct ParseQueue
+{
+	vector<const char *> names;
+	vector<Gerber *> gerbers;			// null for a file that could not be opened
+	size_t next;
+	Mutex mutex;
+};
+
+static void * parseThread(void *arg)
+{
+	ParseQueue &queue = *static_cast<ParseQueue *>(arg);
+	while (1)
+	{
+		size_t k;
+		{
+			MutexLock lock(queue.mutex);
+			if (queue.next == queue.names.size())
+				return 0;
+			k = queue.next++;
+		}
+		FILE *file = fopen(queue.names[k], "rb");
+		if (file == NULL)
+			continue;
+		queue.gerbers[k] = new Gerber(file, imageDPI, optGrowSize, optScaleX, optScaleY, optRotation, optMirrorX, optMirrorY);
+		fclose(file);
+	}
+}
+
+// Parse the files of the queue on up to threadCount threads, including the calling one. Returns the number used.
+static int parseFiles(ParseQueue &queue, int threadCount)
+{
+	queue.gerbers.assign(queue.names.size(), (Gerber *)0);
+	queue.next = 0;
+	vector<pthread_t> threads;
+	for (int i = 1; i < threadCount && i < int(queue.names.size()); i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, 0, parseThread, &queue) != 0)
+			break;
+		threads.push_back(thread);
+	}
+	parseThread(&queue);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], 0);
+	return threads.size() + 1;
+}
+
+
+
 
 //---------------------------------------------------------------------------------
 int main (int argc, char **argv)
@@ -280,6 +460,18 @@ int main (int argc, char **argv)
             {"boarder-mm", required_argument, 0, 'b'},
             {"boarder-pixels", required_argument, 0, 7},
             {"rotation", required_argument, 0, 8},
+            {"arc-tolerance", required_argument, 0, 9},
+            {"arc-tolerance-um", required_argument, 0, 10},
+            {"panel", required_argument, 0, 11},
+            {"simplify", required_argument, 0, 12},
+            {"mirror-x", no_argument, 0, 13},
+            {"mirror-y", no_argument, 0, 14},
+            {"fast-lexer", no_argument, 0, 15},
+            {"cache-dir", required_argument, 0, 16},
+            {"cache-size", required_argument, 0, 17},
+            {"save-geometry", required_argument, 0, 18},
+            {"load-geometry", required_argument, 0, 19},
+            {"threads", required_argument, 0, 20},
             {0, 0, 0, 0}
           };
         // getopt_long stores the option index here.
@@ -293,6 +485,49 @@ int main (int argc, char **argv)
 		switch (c)
 		{
 
+		case 10:
+			optArcTolerance = atof(optarg);
+			optArcToleranceUnitsMicrometers = true;
+		  break;
+		case 15:
+			Gerber::isFastLexerEnabled = true;
+			break;
+		case 16:
+			optCacheDirectory = optarg;
+			break;
+		case 17:
+			optCacheSize = atof(optarg);
+			break;
+		case 18:
+			optSaveGeometry = optarg;
+			break;
+		case 19:
+			optLoadGeometry = optarg;
+			break;
+		case 20:
+			optThreads = atoi(optarg);
+			if (optThreads < 1)
+				error(string("threads must be >= 1"));
+			break;
+		case 13:
+			optMirrorX = true;
+			break;
+		case 14:
+			optMirrorY = true;
+			break;
+		case 12:
+			optSimplifyTolerance = atof(optarg);
+			if (optSimplifyTolerance <= 0 || optSimplifyTolerance >= 0.5)
+				error(string("simplify tolerance must be > 0 and < 0.5 pixels"));
+			break;
+		case 11:
+			if (sscanf(optarg, "%dx%d,%lf,%lf", &optPanelColumns, &optPanelRows, &optPanelPitchX, &optPanelPitchY) != 4)
+				error(string("--panel requires NxM,pitchX,pitchY"));
+			break;
+		case 9:
+			optArcTolerance = atof(optarg);
+			optArcToleranceUnitsMicrometers = false;
+		  break;
 		case 8:
 			optRotation = atof(optarg);
 		  break;
@@ -364,36 +599,75 @@ int main (int argc, char **argv)
 		optGrowSize *= imageDPI/25.4;
 	if ( optBoarderUnitsMillimeters )
 		optBoarder *= imageDPI/25.4;
+	if ( optArcToleranceUnitsMicrometers )
+		optArcTolerance *= imageDPI/25400;
+
+	// Chords of arcs may deviate by the tolerance and their edges round by up to half a pixel. Keeping the
+	// tolerance below half a pixel guarantees an arc edge is never moved by a whole pixel.
+	if (optArcTolerance <= 0 || optArcTolerance >= 0.5)
+		error(string("arc tolerance must be > 0 and < 0.5 pixels"));
+	VertexData::arcTolerance = optArcTolerance;
+	VertexData::simplifyTolerance = optSimplifyTolerance;
+	if (optCacheSize <= 0)
+		error(string("cache size must be > 0"));
+	if (!optCacheDirectory.empty()
+		&& !Gerber::apertureCache.setDirectory(optCacheDirectory, (unsigned long long)(optCacheSize * 1024 * 1024)))
+		error(string("cannot use cache directory ") + optCacheDirectory);
+	if (optPanelColumns < 1 || optPanelRows < 1)
+		error(string("panel must have at least 1 x 1 boards"));
+	optPanelPitchX *= imageDPI/25.4;
+	optPanelPitchY *= imageDPI/25.4;
 
     list<Gerber *> gerbers;			// pointer to the list of Gerber object
 
     bool isStandardInput = false;
-	if (optind == argc)
+	if (optind == argc && optLoadGeometry.empty())
 		isStandardInput = true;
+	if (optind < argc && !optLoadGeometry.empty())
+		error(string("gerber files cannot be given with --load-geometry"));
+	if (!optLoadGeometry.empty())
+	{
+		if (outputFilename.empty())
+			outputFilename = optLoadGeometry + ".tiff";
+		if (!optQuiet)
+			cout << "gerb2tiff: " << optLoadGeometry << " ";
+	}
 
 
 	int first_optind = optind;
 
+	// The gerber files are all parsed before their messages are printed, in the order of the files
+	ParseQueue parseQueue;
+	int parseThreadCount = 1;
+	if (!isStandardInput)
+	{
+		if (optThreads == 0)
+			optThreads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+		parseQueue.names.assign(argv + optind, argv + argc);
+		// flex scans one file at a time, so files read on several threads go through the memory mapped scanner
+		if (optThreads > 1 && parseQueue.names.size() > 1)
+			Gerber::isFastLexerEnabled = true;
+		parseThreadCount = parseFiles(parseQueue, optThreads);
+	}
+
 	for(; optind < argc || isStandardInput; optind++)
 	{
-		FILE *file = 0;
 		if ( isStandardInput )
 		{
-			file = stdin;
 			if (!optTestOnly && outputFilename.empty())
 			{
 				cerr << "no output or input file specified.\n"
 					    "Try 'gerb2tiff --help' for more information.\n";
 				return 1;
 			}
+			gerbers.push_back( new Gerber(stdin, imageDPI, optGrowSize, optScaleX, optScaleY, optRotation, optMirrorX, optMirrorY) );
 		}
 		else
 		{
 			inputfile = argv[optind];
 			if ( outputFilename.empty())
 					outputFilename = inputfile + ".tiff";
-			file = fopen( argv[optind], "rb");
-			if (file == NULL)
+			if (parseQueue.gerbers[optind - first_optind] == 0)
 					error( string("cannot open input file ")+inputfile );
 			if (!optQuiet)
 			{
@@ -401,13 +675,9 @@ int main (int argc, char **argv)
 				if (!optQuiet && optind > first_optind)	cout << "+ ";
 				cout << inputfile << " "<<flush;
 			}
+			gerbers.push_back( parseQueue.gerbers[optind - first_optind] );
 		}
 
-		gerbers.push_back( new Gerber(file, imageDPI, optGrowSize, optScaleX, optScaleY) );
-
-		if (! isStandardInput)
-			fclose(file);
-
 		// print all warning messages
 		for (int i=0; i < gerbers.back()->messages.size() && !optQuiet; i++)
 		{
@@ -434,13 +704,53 @@ int main (int argc, char **argv)
 	int minx =  INT_MAX;
 	int maxy =  INT_MIN;
 	int maxx =  INT_MIN;
-    list<Polygon> globalPolygons;	// Contains polygons created by the all gerbers.
+    PolygonStore globalPolygons;	// Contains polygons created by the all gerbers.
+    FlashStore globalFlashes;		// and the flashes
+    vector<ShapeGroup> globalShapeGroups;
 
-	// group all the polygons
+	// group all the polygons and flashes. The polarity runs of each gerber follow those of the previous one.
+    int polarityRunCount = 0;
     for (list<Gerber*>::iterator it = gerbers.begin(); it != gerbers.end();  it++)
     {
-       globalPolygons.merge((*it)->polygons );
+       globalPolygons.append((*it)->polygons, polarityRunCount );
+       globalFlashes.append((*it)->flashes, polarityRunCount, globalShapeGroups.size() );
+       globalShapeGroups.insert( globalShapeGroups.end(), (*it)->shapeGroups.begin(), (*it)->shapeGroups.end() );
+       polarityRunCount += (*it)->polarityRunCount;
+       (*it)->polygons.clear();
+       (*it)->flashes.clear();
+       vector<ShapeGroup>().swap( (*it)->shapeGroups );
 	}
+    globalPolygons.sort();
+    globalFlashes.sort();
+    bool imagePolarityDark = gerbers.empty() || gerbers.front()->imagePolarityDark;
+
+    // The geometry is only valid for the options it was made with, which are saved with it.
+    vector<double> geometryOptions;
+    geometryOptions.push_back(imageDPI);
+    geometryOptions.push_back(optGrowSize);
+    geometryOptions.push_back(optScaleX);
+    geometryOptions.push_back(optScaleY);
+    geometryOptions.push_back(optRotation);
+    geometryOptions.push_back(optMirrorX);
+    geometryOptions.push_back(optMirrorY);
+    geometryOptions.push_back(optArcTolerance);
+    geometryOptions.push_back(optSimplifyTolerance);
+    Arena<VertexData> geometryVertexArena;		// vertex data of a loaded geometry file
+    clock_t geometryStart = clock();
+    try
+    {
+    	if (!optLoadGeometry.empty())
+    		GeometryFile::load(optLoadGeometry.c_str(), globalPolygons, globalFlashes, globalShapeGroups,
+    						   polarityRunCount, imagePolarityDark, geometryOptions, geometryVertexArena);
+    	if (!optSaveGeometry.empty())
+    		GeometryFile::save(optSaveGeometry.c_str(), globalPolygons, globalFlashes, globalShapeGroups,
+    						   polarityRunCount, imagePolarityDark, geometryOptions);
+    }
+    catch (const string &msg)
+    {
+    	error(msg);
+    }
+    double geometrySeconds = double(clock() - geometryStart) / CLOCKS_PER_SEC;
 
 
 //    for (int i=0; i < 100; i++)
@@ -467,19 +777,123 @@ int main (int argc, char **argv)
 
 
 
-	if (globalPolygons.size()==0 )// If nothing to draw then abort with error
+	if (globalPolygons.size()==0 && globalFlashes.size()==0)// If nothing to draw then abort with error
 		error("no image");
 
 
-	// find extreme (x,y) coordinates for all polygons
-	for (list<Polygon>::iterator it = globalPolygons.begin(); it != globalPolygons.end();  it++)
+	// find extreme (x,y) coordinates for all polygons and flashes
+	for (size_t i = 0; i < globalPolygons.size();  i++)
+	{
+		if (minx > globalPolygons.pixelMinX[i]) 	minx = globalPolygons.pixelMinX[i];
+		if (maxx < globalPolygons.pixelMaxX[i]) 	maxx = globalPolygons.pixelMaxX[i];
+		if (miny > globalPolygons.pixelMinY[i]) 	miny = globalPolygons.pixelMinY[i];
+		if (maxy < globalPolygons.pixelMaxY[i])		maxy = globalPolygons.pixelMaxY[i];
+	}
+	size_t flashedPolygonCount = 0;
+	for (size_t i = 0; i < globalFlashes.size();  i++)
 	{
-		if (minx > it->pixelMinX) 	minx = it->pixelMinX;
-		if (maxx < it->pixelMaxX) 	maxx = it->pixelMaxX;
-		if (miny > it->pixelMinY) 	miny = it->pixelMinY;
-		if (maxy < it->pixelMaxY)	maxy = it->pixelMaxY;
+		const ShapeGroup &group = globalShapeGroups[ globalFlashes.group[i] ];
+		int x1, y1, x2, y2;
+		group.bounds( globalFlashes.offset[i], x1, y1, x2, y2);
+		minx = min(minx, x1);
+		maxx = max(maxx, x2);
+		miny = min(miny, y1);
+		maxy = max(maxy, y2);
+		flashedPolygonCount += group.size();
 	}
 
+	// The image is drawn once for each panel instance, at whole pixel offsets so all instances share the scan line data.
+	// Instances are drawn in order, so the polarity runs of each follow those of the previous one.
+	vector<PanelInstance> instances;
+	for (int iy = 0; iy < optPanelRows; iy++)
+	{
+		for (int ix = 0; ix < optPanelColumns; ix++)
+		{
+			PanelInstance inst;
+			inst.dx = int(floor( ix * optPanelPitchX + 0.5 ));
+			inst.dy = - int(floor( iy * optPanelPitchY + 0.5 ));
+			inst.runOffset = instances.size() * polarityRunCount;
+			inst.polyIndex = 0;
+			inst.flashIndex = 0;
+			instances.push_back(inst);
+		}
+	}
+	int layerMinX = minx, layerMinY = miny, layerMaxX = maxx, layerMaxY = maxy;
+	for (size_t k = 0; k < instances.size(); k++)
+	{
+		minx = min(minx, layerMinX + instances[k].dx);
+		maxx = max(maxx, layerMaxX + instances[k].dx);
+		miny = min(miny, layerMinY + instances[k].dy);
+		maxy = max(maxy, layerMaxY + instances[k].dy);
+	}
+
+    // Remove clear polygons that do not touch any earlier dark polygon in any instance.
+    DarkRunGrid darkRuns(minx, miny, maxx, maxy);
+    for (size_t i = 0; i < globalPolygons.size();  i++)
+    {
+    	if (globalPolygons.polarity[i] == DARK)
+    		for (size_t k = 0; k < instances.size(); k++)
+    			darkRuns.addDark(globalPolygons.pixelMinX[i] + instances[k].dx, globalPolygons.pixelMinY[i] + instances[k].dy,
+    							 globalPolygons.pixelMaxX[i] + instances[k].dx, globalPolygons.pixelMaxY[i] + instances[k].dy,
+    							 globalPolygons.run[i] + instances[k].runOffset);
+    }
+    for (size_t i = 0; i < globalFlashes.size();  i++)
+    {
+    	const ShapeGroup &group = globalShapeGroups[ globalFlashes.group[i] ];
+    	for (size_t j = 0; j < group.size() && !globalFlashes.isClear[i]; j++)
+    	{
+    		if (group.polarity[j] != DARK)
+    			continue;
+    		int x1, y1, x2, y2;
+    		group.polygonBounds( j, globalFlashes.offset[i], x1, y1, x2, y2);
+    		for (size_t k = 0; k < instances.size(); k++)
+    			darkRuns.addDark(x1 + instances[k].dx, y1 + instances[k].dy, x2 + instances[k].dx, y2 + instances[k].dy,
+    							 globalFlashes.run[i] + group.run[j] + instances[k].runOffset);
+    	}
+    }
+    vector<bool> isDrawn(globalPolygons.size(), true);
+    int culledClearPolygons = 0;
+    unsigned long culledClearSpans = 0;
+    for (size_t i = 0; i < globalPolygons.size();  i++)
+    {
+    	if (globalPolygons.polarity[i] != CLEAR)
+    		continue;
+    	isDrawn[i] = false;
+    	for (size_t k = 0; k < instances.size() && !isDrawn[i]; k++)
+    		isDrawn[i] = darkRuns.isDarkBefore(globalPolygons.pixelMinX[i] + instances[k].dx, globalPolygons.pixelMinY[i] + instances[k].dy,
+    										   globalPolygons.pixelMaxX[i] + instances[k].dx, globalPolygons.pixelMaxY[i] + instances[k].dy,
+    										   globalPolygons.run[i] + instances[k].runOffset);
+    	if (!isDrawn[i])
+    		culledClearPolygons++;
+    }
+    globalPolygons.keep(isDrawn);
+
+    // and clear flashes likewise
+    vector<bool> isFlashDrawn(globalFlashes.size(), true);
+    int culledClearFlashes = 0;
+    for (size_t i = 0; i < globalFlashes.size();  i++)
+    {
+    	const ShapeGroup &group = globalShapeGroups[ globalFlashes.group[i] ];
+    	if (!globalFlashes.isClear[i] && !group.isAllClear())
+    		continue;
+    	isFlashDrawn[i] = false;
+    	for (size_t j = 0; j < group.size() && !isFlashDrawn[i]; j++)
+    	{
+    		int x1, y1, x2, y2;
+    		group.polygonBounds( j, globalFlashes.offset[i], x1, y1, x2, y2);
+    		int run = globalFlashes.run[i] + (globalFlashes.isClear[i] ? 0 : group.run[j]);
+    		for (size_t k = 0; k < instances.size() && !isFlashDrawn[i]; k++)
+    			isFlashDrawn[i] = darkRuns.isDarkBefore(x1 + instances[k].dx, y1 + instances[k].dy, x2 + instances[k].dx, y2 + instances[k].dy,
+    													run + instances[k].runOffset);
+    	}
+    	if (!isFlashDrawn[i])
+    	{
+    		culledClearFlashes++;
+    		flashedPolygonCount -= group.size();
+    	}
+    }
+    globalFlashes.keep(isFlashDrawn);
+
 
 	// use the world coordinate limits <maxx, minx, maxx, minx> to determine the
 	// sized  of the bitmap buffer to allocate for drawing the image
@@ -490,10 +904,10 @@ int main (int argc, char **argv)
     int yOffset		= xOffset;
 
     bool isPolarityDark = true;
-    isPolarityDark = (optInvertPolarity ^ gerbers.front()->imagePolarityDark);	// polarity is relative to 1st gerber file
+    isPolarityDark = (optInvertPolarity ^ imagePolarityDark);	// polarity is relative to 1st gerber file
     if ( rowsPerStrip > unsigned(imageHeight) || rowsPerStrip == 0)
     	rowsPerStrip = imageHeight;
-	unsigned darkPixelsCount = 0;
+    unsigned long long darkPixelsCount = 0;
 
 
     //
@@ -501,8 +915,65 @@ int main (int argc, char **argv)
     //
     if (optVerbose >= 2)
     {
-    	printf("polygon count:               %d\n",globalPolygons.size());
+    	int sharedVertexDataCount = 0;
+    	int traceShapeCount = 0, traceShapeSharedCount = 0, redundantFlashCount = 0;
+    	int strokeCount = 0, strokeSegmentCount = 0;
+    	int fastDataBlockCount = 0, fastParameterBlockCount = 0, fastLexerFallbackCount = 0;
+    	unsigned long coordinateCount = 0;
+    	double parseSeconds = 0;
+    	VertexStatistics vertexStatistics = VertexStatistics();
+        for (list<Gerber*>::iterator it = gerbers.begin(); it != gerbers.end();  it++)
+        {
+        	sharedVertexDataCount += (*it)->sharedVertexDataCount;
+        	traceShapeCount += (*it)->traceShapeCount;
+        	traceShapeSharedCount += (*it)->traceShapeSharedCount;
+        	redundantFlashCount += (*it)->redundantFlashCount;
+        	strokeCount += (*it)->strokeCount;
+        	strokeSegmentCount += (*it)->strokeSegmentCount;
+        	fastDataBlockCount += (*it)->fastDataBlockCount;
+        	fastParameterBlockCount += (*it)->fastParameterBlockCount;
+        	fastLexerFallbackCount += (*it)->isFastLexerFallback;
+        	coordinateCount += (*it)->coordinateCount;
+        	parseSeconds += (*it)->parseSeconds;
+        	vertexStatistics += (*it)->vertexStatistics;
+        }
+    	printf("polygon count:               %lu\n",(unsigned long)globalPolygons.size());
+    	printf("flash count:                 %lu (%lu polygons)\n",(unsigned long)globalFlashes.size(), (unsigned long)flashedPolygonCount);
+    	printf("polarity runs:               %d\n",polarityRunCount);
+    	printf("panel instances:             %d x %d\n",optPanelColumns, optPanelRows);
+    	printf("culled clear polygons:       %d\n",culledClearPolygons);
+    	printf("culled clear flashes:        %d\n",culledClearFlashes);
+    	printf("redundant flashes:           %d\n",redundantFlashCount);
+    	printf("shared vertex sets:          %d\n",sharedVertexDataCount);
+    	printf("shared trace shapes:         %d of %d\n",traceShapeSharedCount, traceShapeCount);
+    	printf("aperture cache:              %lu hits, %lu misses, scan tables %lu hits, %lu misses\n",
+    			Gerber::apertureCache.hitCount, Gerber::apertureCache.missCount,
+    			Gerber::apertureCache.scanTableHitCount, Gerber::apertureCache.scanTableMissCount);
+    	if (Gerber::apertureCache.hasDirectory())
+    		printf("aperture cache files:        %lu read, %lu written, %lu evicted\n",
+    				Gerber::apertureCache.fileHitCount, Gerber::apertureCache.fileMissCount,
+    				Gerber::apertureCache.fileEvictCount);
+    	printf("stroked traces:              %d in %d polygons\n",strokeSegmentCount, strokeCount);
+    	if (Gerber::isFastLexerEnabled)
+    		printf("fast lexer blocks:           %d data, %d parameter (%d files finished by flex)\n",
+    				fastDataBlockCount, fastParameterBlockCount, fastLexerFallbackCount);
+    	if (!optLoadGeometry.empty() || !optSaveGeometry.empty())
+    		printf("geometry file:               %s in %.3f s\n", optLoadGeometry.empty() ? "saved" : "loaded", geometrySeconds);
+    	printf("coordinates decoded:         %lu in %.3f s parsing (%.2f million per second)\n",
+    			coordinateCount, parseSeconds, parseSeconds > 0 ? coordinateCount / parseSeconds / 1e6 : 0);
+    	printf("parse threads:               %d\n", parseThreadCount);
     	printf ("grow option:                 %.1f pixels , %.3f mm\n", optGrowSize, optGrowSize/imageDPI*25.4);
+    	printf ("arc vertices:                %lu (tolerance %.3f pixels)\n", vertexStatistics.arcVertexCount, VertexData::arcTolerance);
+    	if (VertexData::simplifyTolerance > 0)
+    		printf ("simplified region vertices:  %lu to %lu in %.3f s (tolerance %.3f pixels)\n",
+    				vertexStatistics.simplifyVertexCount[0], vertexStatistics.simplifyVertexCount[1], vertexStatistics.simplifySeconds,
+    				VertexData::simplifyTolerance);
+    	for (list<Gerber*>::iterator it = gerbers.begin(); it != gerbers.end();  it++)
+    	{
+    		printf ("arena usage:                 %lu nodes %lu KB, %lu vertex sets %lu KB\n",
+    				(unsigned long)(*it)->nodeArena.size(), (unsigned long)(*it)->nodeArena.bytes()/1024,
+    				(unsigned long)(*it)->vertexArena.size(), (unsigned long)(*it)->vertexArena.bytes()/1024);
+    	}
     }
     if (optVerbose >= 1)
     {
@@ -567,8 +1038,8 @@ int main (int argc, char **argv)
 
 
     int stripCounter = 0;
-	list<Polygon>::iterator polyIterator = globalPolygons.begin();
     list<PolygonReference >  activePolys;
+    priority_queue<PolygonReference, vector<PolygonReference>, LaterFirstRow> pendingPolys;	// polygons of flashes not yet reached
 
 	// The bitmap will be divided into strips, of height rowsPerStrip.
 	// Polygons are plotted for each strip consecutively in a loop, where the strip y coordinate equals ystart
@@ -584,38 +1055,63 @@ int main (int argc, char **argv)
 	    // All polygon are sorted in the list globalPolygons. Iterating each polygon for raster data will guarantee no missing lines.
 		for (int y = ystart; (y-ystart) < rowsPerStrip && (y <= maxy); y++ , bufferLine += bytesPerScanline)
 		{
-			while (polyIterator != globalPolygons.end() && y == (polyIterator->pixelMinY))
+			for (size_t k = 0; k < instances.size(); k++)
 			{
-				activePolys.push_back( PolygonReference() );
-				activePolys.back().polygon = &(*polyIterator);
-				activePolys.sort();
-//				printf("added poly %d (y=%d)\n", activePolys.back().polygon->number, y);
-				polyIterator++;
+				PanelInstance &inst = instances[k];
+				while (inst.polyIndex < globalPolygons.size() && y == globalPolygons.pixelMinY[inst.polyIndex] + inst.dy)
+				{
+					PolygonReference ref(globalPolygons, inst.polyIndex, inst.dx, inst.dy, inst.runOffset);
+					insertActive( activePolys, ref);
+//					printf("added poly %d (y=%d)\n", ref.run, y);
+					inst.polyIndex++;
+				}
+
+				// A flash reached on this row creates the references to its polygons, which start on this row or later.
+				while (inst.flashIndex < globalFlashes.size() && y == globalFlashes.pixelMinY[inst.flashIndex] + inst.dy)
+				{
+					const ShapeGroup &group = globalShapeGroups[ globalFlashes.group[inst.flashIndex] ];
+					for (size_t j = 0; j < group.size(); j++)
+						pendingPolys.push( PolygonReference(globalFlashes, inst.flashIndex, group, j, inst.dx, inst.dy, inst.runOffset) );
+					inst.flashIndex++;
+				}
+			}
+			while (!pendingPolys.empty() && pendingPolys.top().pixelMinY == y)
+			{
+				insertActive( activePolys, pendingPolys.top());
+				pendingPolys.pop();
 			}
 
 			for (list<PolygonReference>::iterator it = activePolys.begin();  it != activePolys.end();)
 			{
-				if (y > it->polygon->pixelMaxY)
+				if (y > it->pixelMaxY)
 				{
-//					printf("erased poly %d (y=%d)\n", activePolys.back().polygon->number, y);
+//					printf("erased poly %d (y=%d)\n", it->run, y);
 					it = activePolys.erase(it);
 					continue;
 				}
 				int sliCount;
 				int *sliTable;
-				it->polygon->getNextLineX1X2Pairs( sliTable, sliCount);
+				it->getNextLineX1X2Pairs( sliTable, sliCount);
 
-//				printf("p %2d y:%d (x cnt %d) |",it->polygon->number, y, sliCount); fflush(stdout);
+//				printf("p %2d y:%d (x cnt %d) |",it->run, y, sliCount); fflush(stdout);
 
-				Polarity_t pol =  it->polygon->polarity;
-				if ((pol == DARK) && !isPolarityDark) pol = CLEAR;
-				if ((pol == CLEAR) && isPolarityDark) pol = DARK;
+				// swap polarity for a negative image
+				Polarity_t pol =  it->polarity;
+				if (!isPolarityDark)
+					pol = (pol == DARK) ? CLEAR : DARK;
 
 				for (int i=0; i < sliCount; i+=2)
 				{
+					// skip clear spans over empty area
+					if (it->polarity == CLEAR &&
+						!darkRuns.isDarkBefore(it->pixelOffsetX + sliTable[i], y, it->pixelOffsetX + sliTable[i+1], y, it->run))
+					{
+						culledClearSpans++;
+						continue;
+					}
 //					printf(" %d~%d ",sliTable[i], sliTable[i+1] ); fflush(stdout);
-					horizontalLine( xOffset + it->polygon->pixelOffsetX + sliTable[i], \
-									xOffset + it->polygon->pixelOffsetX + sliTable[i+1], \
+					horizontalLine( xOffset + it->pixelOffsetX + sliTable[i], \
+									xOffset + it->pixelOffsetX + sliTable[i+1], \
 									bufferLine, pol  );
 
 				}
@@ -645,22 +1141,31 @@ int main (int argc, char **argv)
 			{
 				unsigned char *pbitmaprow = bitmap + bytesPerScanline * i;
 				for (int x=0; x < bytesPerScanline; x++)
-					darkPixelsCount += nbitsTable [ *pbitmaprow ];
-					pbitmaprow++;
+					darkPixelsCount += nbitsTable [ pbitmaprow[x] ];
 			}
         }
 
     }
     TIFFClose(tif);
 
+    // Polygons refer to vertex data owned by the gerbers, so the gerbers are only deleted once the image is complete.
+    globalPolygons.clear();
+    globalFlashes.clear();
+    globalShapeGroups.clear();
+    for (list<Gerber*>::iterator it = gerbers.begin(); it != gerbers.end();  it++)
+    	delete *it;
+    gerbers.clear();
+
     if (optVerbose)    	cout << "\n";
 
     if (optShowArea)
     {
     	printf("  dark  area (sq.cm):        %0.1f\n",darkPixelsCount*2.54*2.54/(imageDPI*imageDPI));
-    	printf("  clear area (sq.cm):        %0.1f\n",((imageHeight*imageWidth) - darkPixelsCount*2.54*2.54)/(imageDPI*imageDPI));
+    	printf("  clear area (sq.cm):        %0.1f\n",(double(imageHeight)*imageWidth - darkPixelsCount)*2.54*2.54/(imageDPI*imageDPI));
     }
 
+	if (optVerbose >= 2)
+		printf("  culled clear spans:        %lu\n",culledClearSpans);
 	if (optVerbose)
 		printf("  time (sec):                %.2f\n",((double) (clock() - start_clock)) / CLOCKS_PER_SEC );
 
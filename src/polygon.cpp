@@ -6,6 +6,13 @@
 #include <list>
 #include <cctype>
 #include <math.h>
+#include <time.h>
+#include <map>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -13,6 +20,15 @@ using namespace std;
 
 //#define DEBUG
 
+double VertexData::arcTolerance = 0.01;
+double VertexData::simplifyTolerance = 0;
+static __thread VertexStatistics threadStatistics;	// zero when a thread starts
+
+VertexStatistics & VertexData::statistics()
+{
+	return threadStatistics;
+}
+
 
 /*
  * High speed double to integer conversion replacement for int(floor(0.5 + x))
@@ -78,22 +94,352 @@ public:
 
 
 
+void PolygonStore::push_back( VertexData *vd, const Point &p, Polarity_t pol)
+{
+	pixelMinY.push_back(0);
+	pixelMaxY.push_back(0);
+	pixelOffsetX.push_back(0);
+	vdata.push_back(vd);
+	polarity.push_back(pol);
+	run.push_back(0);
+	offset.push_back(p);
+	pixelMinX.push_back(0);
+	pixelMaxX.push_back(0);
+}
+
+
 /*
- *  Polygon initialisation.
- *   - Sets min and max variables from vertex data.
- *   - Creates scan line intercept X data used for filling the polygon by scan line method.
+ * Add all polygons of rhs, with runOffset added to their run.
+ */
+void PolygonStore::append( const PolygonStore &rhs, int runOffset)
+{
+	pixelMinY.insert( pixelMinY.end(), rhs.pixelMinY.begin(), rhs.pixelMinY.end() );
+	pixelMaxY.insert( pixelMaxY.end(), rhs.pixelMaxY.begin(), rhs.pixelMaxY.end() );
+	pixelOffsetX.insert( pixelOffsetX.end(), rhs.pixelOffsetX.begin(), rhs.pixelOffsetX.end() );
+	vdata.insert( vdata.end(), rhs.vdata.begin(), rhs.vdata.end() );
+	polarity.insert( polarity.end(), rhs.polarity.begin(), rhs.polarity.end() );
+	for (size_t i=0; i < rhs.run.size(); i++)
+		run.push_back( rhs.run[i] + runOffset );
+	offset.insert( offset.end(), rhs.offset.begin(), rhs.offset.end() );
+	pixelMinX.insert( pixelMinX.end(), rhs.pixelMinX.begin(), rhs.pixelMinX.end() );
+	pixelMaxX.insert( pixelMaxX.end(), rhs.pixelMaxX.begin(), rhs.pixelMaxX.end() );
+}
+
+
+void PolygonStore::resize( size_t n)
+{
+	pixelMinY.resize(n);
+	pixelMaxY.resize(n);
+	pixelOffsetX.resize(n);
+	vdata.resize(n);
+	polarity.resize(n);
+	run.resize(n);
+	offset.resize(n);
+	pixelMinX.resize(n);
+	pixelMaxX.resize(n);
+}
+
+
+/*
+ * Remove the polygons i with isKept[i] false, keeping the order of the others.
+ */
+void PolygonStore::keep( const vector<bool> &isKept)
+{
+	size_t k = 0;
+	for (size_t i=0; i < size(); i++)
+	{
+		if (!isKept[i])
+			continue;
+		pixelMinY[k] = pixelMinY[i];
+		pixelMaxY[k] = pixelMaxY[i];
+		pixelOffsetX[k] = pixelOffsetX[i];
+		vdata[k] = vdata[i];
+		polarity[k] = polarity[i];
+		run[k] = run[i];
+		offset[k] = offset[i];
+		pixelMinX[k] = pixelMinX[i];
+		pixelMaxX[k] = pixelMaxX[i];
+		k++;
+	}
+	resize(k);
+}
+
+
+/*
+ * Remove all polygons and release the memory of the arrays.
+ */
+void PolygonStore::clear()
+{
+	PolygonStore empty;
+	std::swap(*this, empty);
+}
+
+
+/*
+ *  Polygon initialisation. Calculates the pixel ranges of polygon i when plotted to a bitmap.
  *
- *   This function shall be called after polygon vertex data has been created.
+ *   This function shall be called after polygon vertex data has been initialised.
  */
-void Polygon::initialise()
+void PolygonStore::initialise( size_t i)
 {
-	// the screen minimum and maximum values are the pixel ranges of the polygon when plotted to a bitmap.
-	pixelMinX = roundDot( vdata->minx + offset.x);
-	pixelMaxX = pixelMinX + vdata->pixelWidth;
-	pixelMinY = roundDot(vdata->miny + offset.y);
-	pixelMaxY = pixelMinY + vdata->pixelHeigth;
-	pixelOffsetX = roundDot( offset.x);
+	pixelMinX[i] = roundDot( vdata[i]->minx + offset[i].x);
+	pixelMaxX[i] = pixelMinX[i] + vdata[i]->pixelWidth;
+	pixelMinY[i] = roundDot(vdata[i]->miny + offset[i].y);
+	pixelMaxY[i] = pixelMinY[i] + vdata[i]->pixelHeigth;
+	pixelOffsetX[i] = roundDot( offset[i].x);
+}
 
+
+/*
+ * Rearrange array elements in the order given by the index list.
+ */
+template<class T> static void permute( vector<T> &v, const vector<int> &order)
+{
+	vector<T> tmp( v.size() );
+	for (size_t i=0; i < order.size(); i++)
+		tmp[i] = v[ order[i] ];
+	v.swap(tmp);
+}
+
+
+/*
+ * Get the order of the keys in ascending value by a stable LSD radix sort, 16 bits per pass.
+ */
+static void radixOrder( const vector<int> &keys, vector<int> &order)
+{
+	order.resize( keys.size() );
+	for (size_t i=0; i < order.size(); i++)
+		order[i] = i;
+	if (keys.size() < 2)
+		return;
+
+	int lowest = *min_element( keys.begin(), keys.end() );
+	unsigned range = unsigned( *max_element( keys.begin(), keys.end() ) - lowest);
+	vector<int> tmp( keys.size() );
+
+	for (int shift = 0; shift < 32 && (range >> shift) != 0; shift += 16)
+	{
+		vector<unsigned> count( 0x10001, 0 );
+		for (size_t i=0; i < keys.size(); i++)
+			count[ ((unsigned(keys[i] - lowest) >> shift) & 0xffff) + 1 ]++;
+		for (size_t k=1; k < count.size(); k++)
+			count[k] += count[k-1];
+		for (size_t i=0; i < order.size(); i++)
+		{
+			int j = order[i];
+			tmp[ count[ (unsigned(keys[j] - lowest) >> shift) & 0xffff ]++ ] = j;
+		}
+		order.swap(tmp);
+	}
+}
+
+
+/*
+ * Sort polygons into ascending pixelMinY order. Polygons of equal pixelMinY remain in the order they were added.
+ */
+void PolygonStore::sort()
+{
+	vector<int> order;
+	radixOrder( pixelMinY, order);
+
+	permute(pixelMinY, order);
+	permute(pixelMaxY, order);
+	permute(pixelOffsetX, order);
+	permute(vdata, order);
+	permute(polarity, order);
+	permute(run, order);
+	permute(offset, order);
+	permute(pixelMinX, order);
+	permute(pixelMaxX, order);
+}
+
+
+
+void ShapeGroup::push_back( VertexData *vd, Polarity_t pol)
+{
+	vdata.push_back(vd);
+	offset.push_back( Point(0,0) );
+	polarity.push_back(pol);
+	run.push_back( run.empty() ? 0 : run.back() + (polarity[polarity.size()-2] != pol) );
+}
+
+
+/*
+ * Remove polygons without vertices.
+ */
+void ShapeGroup::removeEmpty()
+{
+	size_t k = 0;
+	for (size_t j=0; j < size(); j++)
+	{
+		if (vdata[j]->empty())
+			continue;
+		vdata[k] = vdata[j];
+		offset[k] = offset[j];
+		polarity[k] = polarity[j];
+		run[k] = (k == 0) ? 0 : run[k-1] + (polarity[k-1] != polarity[k]);
+		k++;
+	}
+	vdata.resize(k);
+	offset.resize(k);
+	polarity.resize(k);
+	run.resize(k);
+}
+
+
+/*
+ * Pixel range of polygon j when the group is flashed at the given offset, the same as PolygonStore::initialise() gives.
+ */
+void ShapeGroup::polygonBounds( size_t j, const Point &flash, int &minx, int &miny, int &maxx, int &maxy) const
+{
+	Point p = flash + offset[j];
+	minx = roundDot( vdata[j]->minx + p.x);
+	maxx = minx + vdata[j]->pixelWidth;
+	miny = roundDot( vdata[j]->miny + p.y);
+	maxy = miny + vdata[j]->pixelHeigth;
+}
+
+
+/*
+ * Pixel range of the whole group when flashed at the given offset.
+ */
+void ShapeGroup::bounds( const Point &flash, int &minx, int &miny, int &maxx, int &maxy) const
+{
+	minx = miny = INT_MAX;
+	maxx = maxy = INT_MIN;
+	for (size_t j=0; j < size(); j++)
+	{
+		int x1, y1, x2, y2;
+		polygonBounds( j, flash, x1, y1, x2, y2);
+		minx = min(minx, x1);
+		miny = min(miny, y1);
+		maxx = max(maxx, x2);
+		maxy = max(maxy, y2);
+	}
+}
+
+
+bool ShapeGroup::isAllClear() const
+{
+	for (size_t j=0; j < size(); j++)
+		if (polarity[j] != CLEAR)
+			return false;
+	return true;
+}
+
+
+
+void FlashStore::push_back( int g, const Point &p, bool clear, int sequence)
+{
+	pixelMinY.push_back(0);
+	group.push_back(g);
+	run.push_back(sequence);
+	isClear.push_back(clear);
+	offset.push_back(p);
+}
+
+
+/*
+ * Add all flashes of rhs, with runOffset added to their run and groupOffset to their group.
+ */
+void FlashStore::append( const FlashStore &rhs, int runOffset, int groupOffset)
+{
+	pixelMinY.insert( pixelMinY.end(), rhs.pixelMinY.begin(), rhs.pixelMinY.end() );
+	for (size_t i=0; i < rhs.size(); i++)
+	{
+		group.push_back( rhs.group[i] + groupOffset );
+		run.push_back( rhs.run[i] + runOffset );
+	}
+	isClear.insert( isClear.end(), rhs.isClear.begin(), rhs.isClear.end() );
+	offset.insert( offset.end(), rhs.offset.begin(), rhs.offset.end() );
+}
+
+
+void FlashStore::resize( size_t n)
+{
+	pixelMinY.resize(n);
+	group.resize(n);
+	run.resize(n);
+	isClear.resize(n);
+	offset.resize(n);
+}
+
+
+/*
+ * Remove the flashes i with isKept[i] false, keeping the order of the others.
+ */
+void FlashStore::keep( const vector<bool> &isKept)
+{
+	size_t k = 0;
+	for (size_t i=0; i < size(); i++)
+	{
+		if (!isKept[i])
+			continue;
+		pixelMinY[k] = pixelMinY[i];
+		group[k] = group[i];
+		run[k] = run[i];
+		isClear[k] = isClear[i];
+		offset[k] = offset[i];
+		k++;
+	}
+	pixelMinY.resize(k);
+	group.resize(k);
+	run.resize(k);
+	isClear.resize(k);
+	offset.resize(k);
+}
+
+
+void FlashStore::clear()
+{
+	FlashStore empty;
+	std::swap(*this, empty);
+}
+
+
+void FlashStore::initialise( size_t i, const vector<ShapeGroup> &groups)
+{
+	int minx, maxx, maxy;
+	groups[ group[i] ].bounds( offset[i], minx, pixelMinY[i], maxx, maxy);
+}
+
+
+/*
+ * Sort flashes into ascending pixelMinY order. Flashes of equal pixelMinY remain in the order they were added.
+ */
+void FlashStore::sort()
+{
+	vector<int> order;
+	radixOrder( pixelMinY, order);
+
+	permute(pixelMinY, order);
+	permute(group, order);
+	permute(run, order);
+	permute(isClear, order);
+	permute(offset, order);
+}
+
+
+
+PolygonReference::PolygonReference( const FlashStore &flashes, int i, const ShapeGroup &group, int j, int dx, int dy, int runOffset)
+{
+	VertexData *vd = group.vdata[j];
+	Point p = flashes.offset[i] + group.offset[j];
+	nextInTable = &vd->gxIntersects[0];
+	nextInCount = &vd->linesInCounts[0];
+	pixelMinY = roundDot( vd->miny + p.y) + dy;
+	pixelMaxY = pixelMinY + vd->pixelHeigth;
+	pixelOffsetX = roundDot( p.x) + dx;
+	if (flashes.isClear[i])
+	{
+		polarity = CLEAR;
+		run = flashes.run[i] + runOffset;
+	}
+	else
+	{
+		polarity = Polarity_t(group.polarity[j]);
+		run = flashes.run[i] + group.run[j] + runOffset;
+	}
 }
 
 
@@ -110,6 +456,22 @@ void VertexData::initialise()
 	if (vertices.size() == 0)		// nothing to do with no vertices
 		return;
 
+	if (shape == CAPSULE)
+		initialiseCapsule();
+	else if (shape == SECTOR)
+		initialiseSector();
+	else if (shape == STROKE)
+		initialiseStroke();
+	else
+		initialiseOutline();
+}
+
+
+/*
+ * Scan line data for a general polygon. Edges join consecutive vertices, and the last vertex to the first.
+ */
+void VertexData::initialiseOutline()
+{
 	minx = miny = INT_MAX;
 	maxx = maxy = INT_MIN;
 
@@ -182,7 +544,7 @@ void VertexData::initialise()
 		//
 		// Add active edges to the list which have y1 located on current scan line.
 		//
-		while (y >= (currentEdge->ymin) && currentEdge != edges.end())
+		while (currentEdge != edges.end() && y >= (currentEdge->ymin))
 		{
 			active.push_back( &(*currentEdge)  );
 			currentEdge++;
@@ -221,6 +583,386 @@ void VertexData::initialise()
 }
 
 
+
+
+/*
+ * Limits the range [x1, x2] to the values of x satisfying  lo <= a*x + b <= hi.
+ * Returns false when no x satisfies the condition.
+ */
+static bool clipLinear(double a, double b, double lo, double hi, double &x1, double &x2)
+{
+	if (fabs(a) < 1e-12)
+		return (b >= lo && b <= hi);
+	double t1 = (lo - b) / a;
+	double t2 = (hi - b) / a;
+	if (t1 > t2)
+		swap(t1, t2);
+	x1 = max(x1, t1);
+	x2 = min(x2, t2);
+	return x1 <= x2;
+}
+
+
+/*
+ * Gets the x range where the horizontal line at y intersects the capsule P1,P2 with round end radius r.
+ * The capsule is convex, so the intersection is the single range covering the two end circles and the
+ * rectangular band between them. Returns false if the line misses the capsule.
+ */
+static bool capsuleSpan(const Point &P1, const Point &P2, double r, double y, double &x1, double &x2)
+{
+	bool found = false;
+	x1 = INT_MAX;
+	x2 = INT_MIN;
+
+	// chords of the round ends
+	const Point *ends[2] = {&P1, &P2};
+	for (int i=0; i < 2; i++)
+	{
+		double dy = y - ends[i]->y;
+		double h = r*r - dy*dy;
+		if (h < 0)
+			continue;
+		h = sqrt(h);
+		x1 = min(x1, ends[i]->x - h);
+		x2 = max(x2, ends[i]->x + h);
+		found = true;
+	}
+
+	// band of width 2r along the segment. With u the distance along the segment from P1 and v the distance
+	// normal to the segment, the band is 0 <= u <= L and -r <= v <= r, both being linear in x on a scan line.
+	double dx = P2.x - P1.x;
+	double dy = P2.y - P1.y;
+	double L = sqrt(dx*dx + dy*dy);
+	if (L > 0)
+	{
+		double bx1 = INT_MIN;
+		double bx2 = INT_MAX;
+		if ( clipLinear(dx/L, ((y - P1.y)*dy - P1.x*dx)/L, 0, L, bx1, bx2)
+			&& clipLinear(dy/L, (-P1.x*dy - (y - P1.y)*dx)/L, -r, r, bx1, bx2) )
+		{
+			x1 = min(x1, bx1);
+			x2 = max(x2, bx2);
+			found = true;
+		}
+	}
+	return found;
+}
+
+
+/*
+ * Scan line data for a CAPSULE shape. The x range on each scan line is computed directly from the
+ * segment and radius, so no vertices and edge table are needed to represent the round ends.
+ */
+void VertexData::initialiseCapsule()
+{
+	const Point P1 = vertices[0];
+	const Point P2 = vertices.back();
+
+	minx = min(P1.x, P2.x) - radius;
+	maxx = max(P1.x, P2.x) + radius;
+	miny = min(P1.y, P2.y) - radius;
+	maxy = max(P1.y, P2.y) + radius;
+
+	pixelHeigth = roundDot(maxy - miny );
+	pixelWidth  = roundDot(maxx - minx );
+
+	// Same scan line positions as used for outlines, so a capsule plots identically to an equivalent polygon.
+	double y = roundDot(miny) + 0.5;
+	for (int linedc = pixelHeigth; linedc >= 0; linedc--, y += 1.0)
+	{
+		double x1, x2;
+		if (capsuleSpan(P1, P2, radius, y, x1, x2))
+		{
+			gxIntersects.push_back( roundDot(x1) );
+			gxIntersects.push_back( roundDot(x2) );
+			linesInCounts.push_back(2);
+		}
+		else
+		{
+			linesInCounts.push_back(0);
+		}
+	}
+}
+
+
+static bool isNotLeftTurn(const pair<double,double> &a, const pair<double,double> &b, const pair<double,double> &c)
+{
+	return (b.first - a.first) * (c.second - a.second) - (b.second - a.second) * (c.first - a.first) <= 0;
+}
+
+
+/*
+ * Convex hull of the pen placed at both ends of the segment P1,P2, in anticlockwise order. This is the area swept
+ * by the pen moving along the segment.
+ */
+static void sweptHull(const vector<Point> &pen, const Point &P1, const Point &P2, vector<Point> &hull)
+{
+	vector< pair<double,double> > points;
+	for (size_t i=0; i < pen.size(); i++)
+	{
+		points.push_back( make_pair(P1.x + pen[i].x, P1.y + pen[i].y) );
+		points.push_back( make_pair(P2.x + pen[i].x, P2.y + pen[i].y) );
+	}
+	sort(points.begin(), points.end());
+
+	// Andrew's monotone chain, lower half left to right then upper half right to left
+	const int n = points.size();
+	vector< pair<double,double> > h( 2*n );
+	int k = 0;
+	for (int i = 0; i < n; i++)
+	{
+		while (k >= 2 && isNotLeftTurn(h[k-2], h[k-1], points[i]))
+			k--;
+		h[k++] = points[i];
+	}
+	for (int i = n-2, lower = k+1; i >= 0; i--)
+	{
+		while (k >= lower && isNotLeftTurn(h[k-2], h[k-1], points[i]))
+			k--;
+		h[k++] = points[i];
+	}
+	hull.clear();
+	for (int i=0; i < k-1; i++)		// the last point is the first again
+		hull.push_back( Point(h[i].first, h[i].second) );
+}
+
+
+/*
+ * Gets the x range where the horizontal line at y intersects the convex polygon.
+ * Returns false if the line misses the polygon.
+ */
+static bool convexSpan(const vector<Point> &hull, double y, double &x1, double &x2)
+{
+	bool found = false;
+	x1 = INT_MAX;
+	x2 = INT_MIN;
+	for (size_t i=0; i < hull.size(); i++)
+	{
+		const Point &a = hull[i];
+		const Point &b = hull[ (i+1) % hull.size() ];
+		if ((y < a.y && y < b.y) || (y > a.y && y > b.y))
+			continue;
+		double xa = a.x;		// a horizontal edge on the line gives both ends
+		double xb = b.x;
+		if (a.y != b.y)
+			xa = xb = a.x + (y - a.y) * (b.x - a.x) / (b.y - a.y);
+		x1 = min(x1, min(xa, xb));
+		x2 = max(x2, max(xa, xb));
+		found = true;
+	}
+	return found;
+}
+
+
+/*
+ * Scan line data for a STROKE shape, a chain of traces drawn with the same aperture.
+ * Each segment is a capsule for a round pen, or the hull swept by a polygon pen. The ranges of all segments on a
+ * scan line are merged, so the joins are those of the pen and overlapping segments are drawn once.
+ */
+void VertexData::initialiseStroke()
+{
+	Point penMin(-radius, -radius);
+	Point penMax(radius, radius);
+	for (size_t i=0; i < pen.size(); i++)
+	{
+		penMin = Point( i ? min(penMin.x, pen[i].x) : pen[i].x, i ? min(penMin.y, pen[i].y) : pen[i].y );
+		penMax = Point( i ? max(penMax.x, pen[i].x) : pen[i].x, i ? max(penMax.y, pen[i].y) : pen[i].y );
+	}
+
+	minx = miny = INT_MAX;
+	maxx = maxy = INT_MIN;
+	for (size_t i=0; i < vertices.size(); i++)
+	{
+		minx = min(minx, vertices[i].x + penMin.x);
+		maxx = max(maxx, vertices[i].x + penMax.x);
+		miny = min(miny, vertices[i].y + penMin.y);
+		maxy = max(maxy, vertices[i].y + penMax.y);
+	}
+
+	pixelHeigth = roundDot(maxy - miny );
+	pixelWidth  = roundDot(maxx - minx );
+
+	// Same scan line positions as used for outlines. Each segment only visits the scan lines it covers.
+	const double y0 = roundDot(miny) + 0.5;
+	vector< vector< pair<double,double> > > lines( pixelHeigth + 1 );
+	vector<Point> hull;
+	for (size_t i=0; i+1 < vertices.size(); i++)
+	{
+		const Point &P1 = vertices[i];
+		const Point &P2 = vertices[i+1];
+		if (!pen.empty())
+			sweptHull(pen, P1, P2, hull);
+		int first = max(0, int(ceil( min(P1.y, P2.y) + penMin.y - y0 )));
+		int last = min(pixelHeigth, int(floor( max(P1.y, P2.y) + penMax.y - y0 )));
+		for (int k = first; k <= last; k++)
+		{
+			double x1, x2;
+			if (pen.empty() ? capsuleSpan(P1, P2, radius, y0 + k, x1, x2) : convexSpan(hull, y0 + k, x1, x2))
+				lines[k].push_back( make_pair(x1, x2) );
+		}
+	}
+	for (size_t k=0; k < lines.size(); k++)
+		addScanLine(lines[k]);
+}
+
+
+/*
+ * Append the scan line data for one scan line from a list of x ranges.
+ * Overlapping ranges are merged so the x intersections are in ascending pairs.
+ */
+void VertexData::addScanLine( vector< pair<double,double> > &spans )
+{
+	sort(spans.begin(), spans.end());
+	int count = 0;
+	for (size_t i=0; i < spans.size(); )
+	{
+		double x1 = spans[i].first;
+		double x2 = spans[i].second;
+		for (i++; i < spans.size() && spans[i].first <= x2; i++)
+			x2 = max(x2, spans[i].second);
+		gxIntersects.push_back( roundDot(x1) );
+		gxIntersects.push_back( roundDot(x2) );
+		count += 2;
+	}
+	linesInCounts.push_back(count);
+}
+
+
+/*
+ * True if angle theta is on the arc that starts at start_angle and turns sweep radians in the given direction.
+ */
+static bool isOnArc(double theta, double start_angle, double sweep, bool clockwise)
+{
+	double d = clockwise ? (start_angle - theta) : (theta - start_angle);
+	d = fmod(d, 2*M_PI);
+	if (d < 0) d += 2*M_PI;
+	return d <= sweep + 1e-12;
+}
+
+
+/*
+ * Scan line data for a SECTOR shape, an arc trace of a round aperture.
+ * On each scan line the annulus between the inner and outer radius gives up to two x ranges. Each range is then limited
+ * to the angles of the arc, using that the angle seen from the centre changes monotonically along a scan line, so only
+ * the points where the two radial end lines cross the scan line need testing. The round ends are added as circle chords.
+ */
+void VertexData::initialiseSector()
+{
+	const Point centre = vertices[0];
+	const double arc_radius = abs(vertices[1] - centre);
+	const double start_angle = arg(vertices[1] - centre);
+	const double end_angle = start_angle + (isClockwise ? -sweep : sweep);
+	const bool isFullCircle = sweep >= 2*M_PI;
+	const double outer = arc_radius + radius;
+	const double inner = max(0.0, arc_radius - radius);	// no hole when the trace is wider than the arc diameter
+	const double core = radius - arc_radius;			// points this close to the centre are covered at any angle
+	const Point ends[2] = { centre + polar(arc_radius, start_angle), centre + polar(arc_radius, end_angle) };
+
+	// The limits are set by the round ends, the outer arc end points, and any outer arc point at 0, 90, 180 or 270 degrees
+	minx = miny = INT_MAX;
+	maxx = maxy = INT_MIN;
+	vector<Point> extremes;
+	for (int i=0; i < 2; i++)
+	{
+		extremes.push_back( ends[i] - Point(radius, radius) );
+		extremes.push_back( ends[i] + Point(radius, radius) );
+		extremes.push_back( centre + polar(outer, i ? end_angle : start_angle) );
+	}
+	for (int i=0; i < 4; i++)
+	{
+		if (isFullCircle || isOnArc(i*M_PI/2, start_angle, sweep, isClockwise))
+			extremes.push_back( centre + polar(outer, i*M_PI/2) );
+	}
+	for (size_t i=0; i < extremes.size(); i++)
+	{
+		minx = min(minx, extremes[i].x);
+		maxx = max(maxx, extremes[i].x);
+		miny = min(miny, extremes[i].y);
+		maxy = max(maxy, extremes[i].y);
+	}
+
+	pixelHeigth = roundDot(maxy - miny );
+	pixelWidth  = roundDot(maxx - minx );
+
+	vector< pair<double,double> > spans;
+	double y = roundDot(miny) + 0.5;
+	for (int linedc = pixelHeigth; linedc >= 0; linedc--, y += 1.0)
+	{
+		spans.clear();
+		double dy = y - centre.y;
+
+		// x ranges of the annulus
+		vector< pair<double,double> > ring;
+		if (fabs(dy) <= outer)
+		{
+			double xo = sqrt(outer*outer - dy*dy);
+			if (fabs(dy) < inner)
+			{
+				double xi = sqrt(inner*inner - dy*dy);
+				ring.push_back( make_pair(centre.x - xo, centre.x - xi) );
+				ring.push_back( make_pair(centre.x + xi, centre.x + xo) );
+			}
+			else
+			{
+				ring.push_back( make_pair(centre.x - xo, centre.x + xo) );
+			}
+		}
+
+		// the core needs no angle test
+		if (fabs(dy) < core)
+		{
+			double xc = sqrt(core*core - dy*dy);
+			spans.push_back( make_pair(centre.x - xc, centre.x + xc) );
+		}
+
+		// limit the annulus ranges to the arc angles
+		for (size_t k=0; k < ring.size(); k++)
+		{
+			if (isFullCircle)
+			{
+				spans.push_back(ring[k]);
+				continue;
+			}
+			double a = ring[k].first;
+			double b = ring[k].second;
+			vector<double> breaks;
+			breaks.push_back(a);
+			breaks.push_back(b);
+			const double angles[2] = {start_angle, end_angle};
+			for (int i=0; i < 2; i++)
+			{
+				double s = sin(angles[i]);
+				if (s * dy <= 0)		// radial line does not reach this scan line
+					continue;
+				double x = centre.x + dy * cos(angles[i]) / s;
+				if (x > a && x < b)
+					breaks.push_back(x);
+			}
+			if (centre.x > a && centre.x < b)
+				breaks.push_back(centre.x);		// angle jumps when the scan line passes through the centre
+			sort(breaks.begin(), breaks.end());
+			for (size_t i=1; i < breaks.size(); i++)
+			{
+				double mid = (breaks[i-1] + breaks[i]) / 2;
+				if (isOnArc(atan2(dy, mid - centre.x), start_angle, sweep, isClockwise))
+					spans.push_back( make_pair(breaks[i-1], breaks[i]) );
+			}
+		}
+
+		// round ends
+		for (int i=0; i < 2; i++)
+		{
+			double h = radius*radius - (y - ends[i].y)*(y - ends[i].y);
+			if (h < 0)
+				continue;
+			h = sqrt(h);
+			spans.push_back( make_pair(ends[i].x - h, ends[i].x + h) );
+		}
+		addScanLine(spans);
+	}
+}
+
+
 #ifdef DEBUG
 		printf("draw offset (%f, %f) \n", xOffsetDraw, yOffsetDraw );
 		printf("pixelMinY %d, pixelMaxY %d \n", pixelMinY, pixelMaxY );
@@ -268,15 +1010,67 @@ void VertexData::add( double x, double y)
 
 
 /*
- *  Add vertices that follow an arc approximation
+ * Make this a CAPSULE shape; the line segment P1 to P2 with round ends of the given radius.
+ */
+void VertexData::setCapsule(const Point &P1, const Point &P2, double r)
+{
+	shape = CAPSULE;
+	radius = r;
+	vertices.clear();
+	vertices.push_back(P1);
+	vertices.push_back(P2);
+	lastVertex = P2;
+}
+
+
+/*
+ * Make this a STROKE shape; the polyline drawn with a round pen of the given radius, or with the convex polygon pen
+ * when that is not empty.
+ */
+void VertexData::setStroke(const vector<Point> &polyline, double r, const vector<Point> &pen_polygon)
+{
+	shape = STROKE;
+	radius = pen_polygon.empty() ? r : 0;
+	pen = pen_polygon;
+	vertices = polyline;
+	if (!vertices.empty())
+		lastVertex = vertices.back();
+}
+
+
+/*
+ * Make this a SECTOR shape; the arc of radius arc_radius centred at x0,y0 from start_angle to end_angle,
+ * expanded on both sides and at the ends by the given radius. Equal start and end angles give a full circle.
+ */
+void VertexData::setSector(double start_angle, double end_angle, double arc_radius, double x0, double y0, bool clockwise, double r)
+{
+	double arc = fmod(end_angle - start_angle, 2*M_PI);
+	if (arc < 0) arc +=  2*M_PI;
+	if (clockwise) 	arc = 2*M_PI - arc;
+	if (arc < 1e-10 || arc > 2*M_PI - 1e-10)
+		arc = 2*M_PI;
+
+	shape = SECTOR;
+	radius = r;
+	sweep = arc;
+	isClockwise = clockwise;
+	vertices.clear();
+	vertices.push_back( Point(x0, y0) );
+	vertices.push_back( Point(x0, y0) + polar(arc_radius, start_angle) );
+	lastVertex = vertices.back();
+}
+
+
+/*
+ *  Add vertices that follow an arc approximation.
+ *  The number of vertices is the least to keep the chords within arcTolerance pixels of the arc.
  */
 void VertexData::addArc(double start_angle, double end_angle, double radius, double x0, double y0, bool clockwise)
 {
 
-	double deviaion = 0.01;
+	double deviaion = arcTolerance;
 	if (radius < 0.5)		radius = 0.5;
-	if (radius < 150)		deviaion *= (radius/150);
-	if (deviaion < 0.01)	deviaion = 0.01;
+	if (deviaion > radius)	deviaion = radius;
 	double step = 2*acos(1 - deviaion / radius);				// calculate minimum step magnitude to satisfy maximum deviation
 
 	if (start_angle < 0)  start_angle += 2*M_PI;
@@ -287,18 +1081,98 @@ void VertexData::addArc(double start_angle, double end_angle, double radius, dou
 	if (arc < 0) arc +=  2*M_PI;
 	if (clockwise) 	arc = 2*M_PI - arc;
 
-	int N = int(ceil( arc / step)); 	// get integer number of arc divisions
-	step = arc / (N-1);					// re-calculate the step angle for integer divisions.
-	if (N < 2) 		return;
+	int N = max(1, int(ceil( arc / step))); 	// get integer number of chords
+	step = arc / N;								// re-calculate the step angle for integer divisions.
 	if (clockwise) 	step *= -1;
 
+	// Vertices are found by rotating the radius vector by step each time, so only one cos() and sin() are needed per arc.
+	// The last vertex is the exact end point.
+	const double cos_step = cos(step);
+	const double sin_step = sin(step);
+	double x = radius * cos(theta);
+	double y = radius * sin(theta);
 	for (int i=0; i < N; i++)
 	{
-		double const x = radius * cos(theta) + x0;
-		double const y = radius * sin(theta) + y0;
-		theta += step;
-		add(x,y);
+		add(x + x0, y + y0);
+		double const x_next = x * cos_step - y * sin_step;
+		y = y * cos_step + x * sin_step;
+		x = x_next;
 	}
+	add(radius * cos(end_angle) + x0, radius * sin(end_angle) + y0);
+	threadStatistics.arcVertexCount += N + 1;
+}
+
+
+/*
+ * Distance of P from the line segment A,B
+ */
+static double segmentDistance(const Point &P, const Point &A, const Point &B)
+{
+	Point AB = B - A;
+	double len_sq = abs_sq(AB);
+	double t = (len_sq > 0) ? ((P.x - A.x)*AB.x + (P.y - A.y)*AB.y) / len_sq : 0;
+	if (t < 0) t = 0;
+	if (t > 1) t = 1;
+	return abs(P - (A + AB*t));
+}
+
+
+/*
+ * Remove outline vertices by the Douglas-Peucker method, so every removed vertex is within simplifyTolerance pixels
+ * of the edge that replaces it. The closed outline is split at the first vertex and the vertex furthest from it,
+ * and each half is simplified without recursion, as region outlines can have very many vertices.
+ */
+void VertexData::simplify()
+{
+	const int N = vertices.size();
+	if (shape != OUTLINE || N < 4 || simplifyTolerance <= 0)
+		return;
+	double start = threadSeconds();
+
+	int far = 0;
+	for (int i=1; i < N; i++)
+		if (abs_sq(vertices[i] - vertices[0]) > abs_sq(vertices[far] - vertices[0]))
+			far = i;
+
+	vector<bool> isKept(N, false);
+	isKept[0] = isKept[far] = true;
+	vector< pair<int,int> > stack;					// chains first..last, the last may be N for vertex 0
+	stack.push_back( make_pair(0, far) );
+	stack.push_back( make_pair(far, N) );
+	while (!stack.empty())
+	{
+		int first = stack.back().first;
+		int last = stack.back().second;
+		stack.pop_back();
+		const Point &A = vertices[first];
+		const Point &B = vertices[last % N];
+		double worst = simplifyTolerance;
+		int split = -1;
+		for (int i = first+1; i < last; i++)
+		{
+			double d = segmentDistance(vertices[i], A, B);
+			if (d > worst)
+			{
+				worst = d;
+				split = i;
+			}
+		}
+		if (split < 0)
+			continue;
+		isKept[split] = true;
+		stack.push_back( make_pair(first, split) );
+		stack.push_back( make_pair(split, last) );
+	}
+
+	int k = 0;
+	for (int i=0; i < N; i++)
+		if (isKept[i])
+			vertices[k++] = vertices[i];
+	vertices.resize(k);
+
+	threadStatistics.simplifyVertexCount[0] += N;
+	threadStatistics.simplifyVertexCount[1] += k;
+	threadStatistics.simplifySeconds += threadSeconds() - start;
 }
 
 
@@ -339,30 +1213,99 @@ void VertexData::addRectangle(double x_size, double y_size, double x0, double y0
 
 
 /*
- * Rotate vertices of polygon about origin in the counter clockwise direction.
- * by <radian> radian.
+ * Apply the linear part of the transform to all vertices. The translation belongs to the polygon offset, which is
+ * transformed by the caller.
+ * Round shapes only stay round under a similarity transform, otherwise they are first replaced by straight line
+ * approximations.
  */
-void VertexData::rotate(double theta)
+void VertexData::transform(const Transform &m)
 {
+	if (!m.isSimilarity() && (shape == CAPSULE || shape == SECTOR || (shape == STROKE && pen.empty())))
+		tessellate();
+
+	double det = m.determinant();
+	radius *= sqrt(fabs(det));
+	if (det < 0)
+		isClockwise = !isClockwise;		// mirroring reverses the turning direction of an arc
+
 	for (int i=0; i < vertices.size(); i++)
+		vertices[i] = m.linear(vertices[i]);
+	for (size_t i=0; i < pen.size(); i++)
+		pen[i] = m.linear(pen[i]);
+}
+
+
+/*
+ * Replace the round parts of a CAPSULE or SECTOR by arcs, making it an OUTLINE, or the round pen of a STROKE by a polygon.
+ */
+void VertexData::tessellate()
+{
+	vector<Point> v;
+	v.swap(vertices);
+	const double r = radius;
+	if (shape == CAPSULE)
+	{
+		// half circles about each end, joined by the sides
+		double a = (v.back() == v[0]) ? 0 : arg(v.back() - v[0]);
+		addArc(a - M_PI/2, a + M_PI/2, r, v.back().x, v.back().y, false);
+		addArc(a + M_PI/2, a + 3*M_PI/2, r, v[0].x, v[0].y, false);
+	}
+	else if (shape == SECTOR)
 	{
-		vertices[i].rotate(theta);
+		// the outer arc, then the inner arc back, joined by half circles about the ends, all turning anticlockwise
+		const Point centre = v[0];
+		const double arc_radius = abs(v[1] - centre);
+		double a0 = fmod(arg(v[1] - centre) - (isClockwise ? sweep : 0), 2*M_PI);
+		if (a0 < 0) a0 += 2*M_PI;
+		const double a1 = a0 + sweep;
+		const Point ends[2] = { centre + polar(arc_radius, a0), centre + polar(arc_radius, a1) };
+		if (sweep >= 2*M_PI)
+		{
+			addArc(a0, a0 + 2*M_PI, arc_radius + r, centre.x, centre.y, false);
+			addArc(a0 + 2*M_PI, a0, arc_radius - r, centre.x, centre.y, true);
+		}
+		else
+		{
+			addArc(a0, a1, arc_radius + r, centre.x, centre.y, false);
+			addArc(a1, a1 + M_PI, r, ends[1].x, ends[1].y, false);
+			addArc(a1, a0, arc_radius - r, centre.x, centre.y, true);
+			addArc(a0 + M_PI, a0 + 2*M_PI, r, ends[0].x, ends[0].y, false);
+		}
 	}
+	else
+	{
+		// a regular polygon with corners on the circle, within arcTolerance of it
+		vertices.swap(v);
+		double step = 2*acos(1 - min(arcTolerance, r) / max(r, 0.5));
+		int N = max(8, int(ceil(2*M_PI / step)));
+		pen.clear();
+		for (int i=0; i < N; i++)
+			pen.push_back( polar(r, 2*M_PI*i / N) );
+		radius = 0;
+		return;
+	}
+	shape = OUTLINE;
+	radius = 0;
+	sweep = 0;
+}
+
+
+/*
+ * Rotate vertices of polygon about origin in the counter clockwise direction.
+ * by <radian> radian.
+ */
+void VertexData::rotate(double theta)
+{
+	transform( Transform::rotation(theta) );
 }
 
 /*
  * Scale vertices of the polygon by multiplying all x coordinates by scaleX, and all y coordinates by scaleY
+ * Round shapes keep their shape only for equal magnitude factors, see transform().
  */
 void VertexData::scale(double scaleX,  double scaleY )
 {
-	int N = vertices.size();
-	if (N == 0)
-		return;
-	for (int i=0; i < N; i++ )
-	{
-		vertices[i].x *= scaleX;
-		vertices[i].y *= scaleY;
-	}
+	transform( Transform::scaling(scaleX, scaleY) );
 }
 
 
@@ -391,3 +1334,355 @@ void Point::rotate(const double &radian)
 }
 
 
+
+
+
+//------------------------------------------------------------
+//				Geometry file
+//------------------------------------------------------------
+//
+// The header is followed by the options, then arrays of the records below: the vertex sets, the polygons,
+// the shape groups, the polygons of all groups and the flashes. Last are the x intersections of all vertex
+// sets, then their counts per line. All sections are a multiple of 8 bytes.
+//
+struct GeometryHeader
+{
+	char magic[8];
+	unsigned int version;
+	unsigned int optionCount;
+	unsigned int vertexSetCount;
+	unsigned int polygonCount;
+	unsigned int groupCount;
+	unsigned int groupPolygonCount;
+	unsigned int flashCount;
+	int polarityRunCount;
+	int isPolarityDark;
+	unsigned int reserved;
+	unsigned long long intersectCount;
+	unsigned long long lineCount;
+};
+
+struct GeometryVertexSet
+{
+	double minx, miny, maxx, maxy;
+	int pixelHeigth;
+	int pixelWidth;
+	unsigned int intersectCount;
+	unsigned int lineCount;
+};
+
+struct GeometryPolygon
+{
+	double x, y;					// offset
+	int vertexSet;
+	int run;
+	int polarity;
+	int reserved;
+};
+
+struct GeometryGroup
+{
+	unsigned int first;				// index of the first polygon in the group polygons
+	unsigned int count;
+};
+
+struct GeometryFlash
+{
+	double x, y;
+	int group;
+	int run;
+	int isClear;
+	int reserved;
+};
+
+static const char geometryMagic[8] = "G2TGEOM";
+
+static size_t geometryFileSize( const GeometryHeader &h)
+{
+	size_t ints = size_t(h.intersectCount + h.lineCount);
+	return sizeof(h) + h.optionCount * sizeof(double) + h.vertexSetCount * sizeof(GeometryVertexSet)
+			+ (h.polygonCount + h.groupPolygonCount) * sizeof(GeometryPolygon) + h.groupCount * sizeof(GeometryGroup)
+			+ h.flashCount * sizeof(GeometryFlash) + (ints + 1) / 2 * 2 * sizeof(int);
+}
+
+
+// A pixel coordinate that converts to int, false for damaged values
+static bool isPixelCoordinate( double x)
+{
+	return fabs(x) < INT_MAX/2;
+}
+
+
+template<class T> static void writeRecords( FILE *fp, const vector<T> &v)
+{
+	if (!v.empty() && fwrite(&v[0], sizeof(T), v.size(), fp) != v.size())
+		throw string("write failed");
+}
+
+
+/*
+ * Write the image geometry to path. Vertex data used by several polygons and groups is written once.
+ */
+void GeometryFile::save( const char *path, const PolygonStore &polygons, const FlashStore &flashes,
+						 const vector<ShapeGroup> &groups, int polarityRunCount, bool isPolarityDark,
+						 const vector<double> &options)
+{
+	map<VertexData *, int> index;
+	vector<VertexData *> sets;
+	vector<GeometryPolygon> polygonRecords, groupPolygonRecords;
+	vector<GeometryGroup> groupRecords;
+	vector<GeometryFlash> flashRecords;
+
+	for (size_t i=0; i < polygons.size() + groups.size(); i++)
+	{
+		bool isGroup = i >= polygons.size();
+		const ShapeGroup *group = isGroup ? &groups[i - polygons.size()] : 0;
+		size_t count = isGroup ? group->size() : 1;
+		if (isGroup)
+		{
+			GeometryGroup g = { (unsigned int)groupPolygonRecords.size(), (unsigned int)count };
+			groupRecords.push_back(g);
+		}
+		for (size_t j=0; j < count; j++)
+		{
+			VertexData *vd = isGroup ? group->vdata[j] : polygons.vdata[i];
+			map<VertexData *, int>::iterator it = index.find(vd);
+			if (it == index.end())
+			{
+				it = index.insert( make_pair(vd, int(sets.size())) ).first;
+				sets.push_back(vd);
+			}
+			GeometryPolygon p;
+			memset(&p, 0, sizeof(p));
+			p.vertexSet = it->second;
+			if (isGroup)
+			{
+				p.x = group->offset[j].x;
+				p.y = group->offset[j].y;
+				p.run = group->run[j];
+				p.polarity = group->polarity[j];
+				groupPolygonRecords.push_back(p);
+			}
+			else
+			{
+				p.x = polygons.offset[i].x;
+				p.y = polygons.offset[i].y;
+				p.run = polygons.run[i];
+				p.polarity = polygons.polarity[i];
+				polygonRecords.push_back(p);
+			}
+		}
+	}
+	for (size_t i=0; i < flashes.size(); i++)
+	{
+		GeometryFlash f;
+		memset(&f, 0, sizeof(f));
+		f.x = flashes.offset[i].x;
+		f.y = flashes.offset[i].y;
+		f.group = flashes.group[i];
+		f.run = flashes.run[i];
+		f.isClear = flashes.isClear[i];
+		flashRecords.push_back(f);
+	}
+
+	GeometryHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, geometryMagic, sizeof(h.magic));
+	h.version = FILE_VERSION;
+	h.optionCount = options.size();
+	h.vertexSetCount = sets.size();
+	h.polygonCount = polygonRecords.size();
+	h.groupCount = groupRecords.size();
+	h.groupPolygonCount = groupPolygonRecords.size();
+	h.flashCount = flashRecords.size();
+	h.polarityRunCount = polarityRunCount;
+	h.isPolarityDark = isPolarityDark;
+	vector<GeometryVertexSet> setRecords(sets.size());
+	for (size_t k=0; k < sets.size(); k++)
+	{
+		GeometryVertexSet &s = setRecords[k];
+		memset(&s, 0, sizeof(s));
+		s.minx = sets[k]->minx;
+		s.miny = sets[k]->miny;
+		s.maxx = sets[k]->maxx;
+		s.maxy = sets[k]->maxy;
+		s.pixelHeigth = sets[k]->pixelHeigth;
+		s.pixelWidth = sets[k]->pixelWidth;
+		s.intersectCount = sets[k]->gxIntersects.size();
+		s.lineCount = sets[k]->linesInCounts.size();
+		h.intersectCount += s.intersectCount;
+		h.lineCount += s.lineCount;
+	}
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == 0)
+		throw string("cannot create geometry file ") + path;
+	try
+	{
+		writeRecords(fp, vector<GeometryHeader>(1, h));
+		writeRecords(fp, options);
+		writeRecords(fp, setRecords);
+		writeRecords(fp, polygonRecords);
+		writeRecords(fp, groupRecords);
+		writeRecords(fp, groupPolygonRecords);
+		writeRecords(fp, flashRecords);
+		for (size_t k=0; k < sets.size(); k++)
+			writeRecords(fp, sets[k]->gxIntersects);
+		for (size_t k=0; k < sets.size(); k++)
+			writeRecords(fp, sets[k]->linesInCounts);
+		if ((h.intersectCount + h.lineCount) % 2)
+			writeRecords(fp, vector<int>(1, 0));
+	}
+	catch (const string &)
+	{
+		fclose(fp);
+		throw string("cannot write geometry file ") + path;
+	}
+	if (fclose(fp) != 0)
+		throw string("cannot write geometry file ") + path;
+}
+
+
+/*
+ * Read the image geometry of path into the empty stores, with new vertex data in vertexArena.
+ */
+void GeometryFile::load( const char *path, PolygonStore &polygons, FlashStore &flashes,
+						 vector<ShapeGroup> &groups, int &polarityRunCount, bool &isPolarityDark,
+						 const vector<double> &options, Arena<VertexData> &vertexArena)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		throw string("cannot open geometry file ") + path;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(GeometryHeader))
+	{
+		close(fd);
+		throw string(path) + " is not a geometry file";
+	}
+	size_t size = st.st_size;
+	void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw string("cannot read geometry file ") + path;
+
+	const GeometryHeader &h = *static_cast<const GeometryHeader *>(map);
+	string msg;
+	if (memcmp(h.magic, geometryMagic, sizeof(h.magic)) != 0)
+		msg = string(path) + " is not a geometry file";
+	else if (h.version != FILE_VERSION)
+		msg = string(path) + " was saved by another version of gerb2tiff";
+	else if (geometryFileSize(h) != size)
+		msg = string("geometry file ") + path + " is truncated or damaged";
+	else if (h.optionCount != options.size() || (h.optionCount > 0
+			 && memcmp(&h + 1, &options[0], h.optionCount * sizeof(double)) != 0))
+		msg = string("geometry file ") + path + " was made with different dpi, grow, scale, rotation, mirror, "
+				"arc tolerance or simplify options";
+	if (!msg.empty())
+	{
+		munmap(map, size);
+		throw msg;
+	}
+
+	const GeometryVertexSet *setRecords = reinterpret_cast<const GeometryVertexSet *>(
+											reinterpret_cast<const double *>(&h + 1) + h.optionCount);
+	const GeometryPolygon *polygonRecords = reinterpret_cast<const GeometryPolygon *>(setRecords + h.vertexSetCount);
+	const GeometryGroup *groupRecords = reinterpret_cast<const GeometryGroup *>(polygonRecords + h.polygonCount);
+	const GeometryPolygon *groupPolygonRecords = reinterpret_cast<const GeometryPolygon *>(groupRecords + h.groupCount);
+	const GeometryFlash *flashRecords = reinterpret_cast<const GeometryFlash *>(groupPolygonRecords + h.groupPolygonCount);
+	const int *intersects = reinterpret_cast<const int *>(flashRecords + h.flashCount);
+	const int *lineCounts = intersects + h.intersectCount;
+
+	// Check the indices, and the scan tables the rasterizer uses unchecked, before any are used
+	unsigned long long intersectCount = 0, lineCount = 0;
+	bool isValid = h.polarityRunCount >= 0;
+	for (size_t k=0; k < h.vertexSetCount && isValid; k++)
+	{
+		const GeometryVertexSet &s = setRecords[k];
+		isValid = (s.lineCount == 0 || (s.pixelHeigth >= 0 && s.lineCount == (unsigned long long)s.pixelHeigth + 1
+										&& s.pixelWidth >= 0 && isPixelCoordinate(s.minx) && isPixelCoordinate(s.miny)
+										&& isPixelCoordinate(s.maxx) && isPixelCoordinate(s.maxy)))
+				&& lineCount + s.lineCount <= h.lineCount && intersectCount + s.intersectCount <= h.intersectCount;
+		unsigned long long count = 0;
+		for (size_t j=0; j < s.lineCount && isValid; j++)
+		{
+			isValid = lineCounts[lineCount + j] >= 0;
+			count += lineCounts[lineCount + j];
+		}
+		isValid = isValid && count == s.intersectCount;
+		const int x1 = isValid && s.lineCount > 0 ? roundDot(s.minx) : 0;
+		for (size_t j=0; j < s.intersectCount && isValid; j++)
+			isValid = intersects[intersectCount + j] >= x1 && intersects[intersectCount + j] <= x1 + s.pixelWidth + 1;
+		intersectCount += s.intersectCount;
+		lineCount += s.lineCount;
+	}
+	isValid = isValid && intersectCount == h.intersectCount && lineCount == h.lineCount;
+	for (size_t i=0; i < h.polygonCount && isValid; i++)
+	{
+		const GeometryPolygon &p = polygonRecords[i];
+		isValid = p.vertexSet >= 0 && unsigned(p.vertexSet) < h.vertexSetCount && isPixelCoordinate(p.x) && isPixelCoordinate(p.y)
+				&& (p.polarity == DARK || p.polarity == CLEAR) && p.run >= 0 && p.run < h.polarityRunCount;
+	}
+	for (size_t i=0; i < h.groupPolygonCount && isValid; i++)
+	{
+		const GeometryPolygon &p = groupPolygonRecords[i];
+		isValid = p.vertexSet >= 0 && unsigned(p.vertexSet) < h.vertexSetCount && isPixelCoordinate(p.x) && isPixelCoordinate(p.y)
+				&& (p.polarity == DARK || p.polarity == CLEAR) && p.run >= 0 && p.run < h.polarityRunCount;
+	}
+	for (size_t g=0; g < h.groupCount && isValid; g++)
+		isValid = groupRecords[g].first <= h.groupPolygonCount && groupRecords[g].count <= h.groupPolygonCount - groupRecords[g].first;
+	for (size_t i=0; i < h.flashCount && isValid; i++)
+		isValid = flashRecords[i].group >= 0 && unsigned(flashRecords[i].group) < h.groupCount
+				&& isPixelCoordinate(flashRecords[i].x) && isPixelCoordinate(flashRecords[i].y)
+				&& flashRecords[i].run >= 0 && flashRecords[i].run < h.polarityRunCount;
+	if (!isValid)
+	{
+		munmap(map, size);
+		throw string("geometry file ") + path + " is damaged";
+	}
+
+	vector<VertexData *> sets(h.vertexSetCount);
+	for (size_t k=0; k < h.vertexSetCount; k++)
+	{
+		const GeometryVertexSet &s = setRecords[k];
+		VertexData *vd = sets[k] = new (vertexArena) VertexData;
+		vd->minx = s.minx;
+		vd->miny = s.miny;
+		vd->maxx = s.maxx;
+		vd->maxy = s.maxy;
+		vd->pixelHeigth = s.pixelHeigth;
+		vd->pixelWidth = s.pixelWidth;
+		vd->gxIntersects.assign(intersects, intersects + s.intersectCount);
+		vd->linesInCounts.assign(lineCounts, lineCounts + s.lineCount);
+		intersects += s.intersectCount;
+		lineCounts += s.lineCount;
+	}
+
+	for (size_t i=0; i < h.polygonCount; i++)
+	{
+		const GeometryPolygon &p = polygonRecords[i];
+		polygons.push_back( sets[p.vertexSet], Point(p.x, p.y), Polarity_t(p.polarity));
+		polygons.run.back() = p.run;
+		polygons.initialise(i);
+	}
+	groups.resize(h.groupCount);
+	for (size_t g=0; g < h.groupCount; g++)
+	{
+		for (size_t j=0; j < groupRecords[g].count; j++)
+		{
+			const GeometryPolygon &p = groupPolygonRecords[ groupRecords[g].first + j ];
+			groups[g].vdata.push_back( sets[p.vertexSet] );
+			groups[g].offset.push_back( Point(p.x, p.y) );
+			groups[g].polarity.push_back( p.polarity );
+			groups[g].run.push_back( p.run );
+		}
+	}
+	for (size_t i=0; i < h.flashCount; i++)
+	{
+		const GeometryFlash &f = flashRecords[i];
+		flashes.push_back( f.group, Point(f.x, f.y), f.isClear, f.run);
+		flashes.initialise(i, groups);
+	}
+	polarityRunCount = h.polarityRunCount;
+	isPolarityDark = h.isPolarityDark;
+	munmap(map, size);
+}
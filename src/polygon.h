@@ -3,6 +3,8 @@
 
 #include <limits.h>
 #include <algorithm>
+#include "arena.h"
+#include "threads.h"
 
 /*  Constants used to specify how objects are to be plotted to the bitmap */
 typedef  enum {DARK, CLEAR, XOR} Polarity_t;
@@ -18,12 +20,12 @@ public:
 	double y;
 	Point(double X, double Y) : x(X), y(Y) { }
 	Point() { }
-	Point operator*(const double &fac) { return Point(x*fac, y*fac); }
-	Point operator/(const double &den) { return Point(x/den, y/den); }
-	Point operator-(const Point &rhs) { return Point(x-rhs.x, y-rhs.y); }
-	Point operator+(const Point &rhs) { return Point(x+rhs.x, y+rhs.y); }
-	bool operator!=(const Point &rhs) { return x != rhs.x || y != rhs.y; }
-	bool operator==(const Point &rhs) { return x == rhs.x && y == rhs.y; }
+	Point operator*(const double &fac) const { return Point(x*fac, y*fac); }
+	Point operator/(const double &den) const { return Point(x/den, y/den); }
+	Point operator-(const Point &rhs) const { return Point(x-rhs.x, y-rhs.y); }
+	Point operator+(const Point &rhs) const { return Point(x+rhs.x, y+rhs.y); }
+	bool operator!=(const Point &rhs) const { return x != rhs.x || y != rhs.y; }
+	bool operator==(const Point &rhs) const { return x == rhs.x && y == rhs.y; }
 	void rotate(const double &radians_anticlockwise);
 };
 
@@ -32,6 +34,65 @@ inline double abs_sq(const Point &P) { return (P.x*P.x + P.y*P.y); }
 inline double arg(const Point &P) { return atan2(P.y, P.x); }
 inline Point polar(const double &rho, const double &theta) { return Point( rho*cos(theta), rho*sin(theta)); }
 
+
+/*
+ * Affine transform of points: x' = xx*x + xy*y + dx,  y' = yx*x + yy*y + dy
+ */
+class Transform
+{
+public:
+	double xx, xy, yx, yy;
+	double dx, dy;
+
+	Transform() : xx(1), xy(0), yx(0), yy(1), dx(0), dy(0) { }
+	Transform(double XX, double XY, double YX, double YY, double DX = 0, double DY = 0)
+		: xx(XX), xy(XY), yx(YX), yy(YY), dx(DX), dy(DY) { }
+
+	// Quarter turns are made exact so a rotated image maps pixel for pixel onto the unrotated one.
+	static Transform rotation(double radians_anticlockwise)
+	{
+		double quarters = radians_anticlockwise / (M_PI/2);
+		double q = floor(quarters + 0.5);
+		if (fabs(quarters - q) < 1e-12)
+		{
+			static const double s[4] = { 0, 1, 0, -1 };
+			int k = (int)fmod(q, 4.0);
+			if (k < 0)	k += 4;
+			return Transform(s[(k+1) & 3], -s[k], s[k], s[(k+1) & 3]);
+		}
+		double c = cos(radians_anticlockwise);
+		double s = sin(radians_anticlockwise);
+		return Transform(c, -s, s, c);
+	}
+	static Transform scaling(double scaleX, double scaleY)	{ return Transform(scaleX, 0, 0, scaleY); }
+	static Transform mirror(bool mirrorX, bool mirrorY)		{ return scaling(mirrorX ? -1 : 1, mirrorY ? -1 : 1); }
+
+	// The transform that applies rhs first, then this one
+	Transform operator*(const Transform &rhs) const
+	{
+		return Transform( xx*rhs.xx + xy*rhs.yx, xx*rhs.xy + xy*rhs.yy,
+						  yx*rhs.xx + yy*rhs.yx, yx*rhs.xy + yy*rhs.yy,
+						  xx*rhs.dx + xy*rhs.dy + dx, yx*rhs.dx + yy*rhs.dy + dy );
+	}
+	Point operator()(const Point &P) const	{ return Point(xx*P.x + xy*P.y + dx, yx*P.x + yy*P.y + dy); }
+	Point linear(const Point &P) const		{ return Point(xx*P.x + xy*P.y, yx*P.x + yy*P.y); }
+	double determinant() const				{ return xx*yy - xy*yx; }
+	bool isIdentity() const		{ return xx == 1 && xy == 0 && yx == 0 && yy == 1 && dx == 0 && dy == 0; }
+
+	// True for quarter turns and mirrors, which move whole pixel positions to whole pixel positions.
+	bool isQuarterTurn() const
+	{
+		return xx == floor(xx) && xy == floor(xy) && yx == floor(yx) && yy == floor(yy) && dx == floor(dx) && dy == floor(dy);
+	}
+
+	// True if circles stay circles, that is a rotation, mirror and equal scaling in both axes.
+	bool isSimilarity() const
+	{
+		double scale = fabs(determinant());
+		return fabs(xx*xy + yx*yy) <= 1e-9 * scale && fabs(xx*xx + yx*yx - scale) <= 1e-9 * scale;
+	}
+};
+
 //
 // A general line equation object
 //
@@ -101,6 +162,35 @@ public:
 };
 
 
+/*
+ * Work done by addArc() and simplify(). Each thread counts its own, so the counts of every file are taken while it
+ * is parsed and added up after all the parse threads are joined.
+ */
+struct VertexStatistics
+{
+	unsigned long arcVertexCount;			// number of vertices created by addArc()
+	unsigned long simplifyVertexCount[2];	// number of vertices before and after simplify()
+	double simplifySeconds;					// time spent in simplify()
+
+	VertexStatistics & operator+=(const VertexStatistics &s)
+	{
+		arcVertexCount += s.arcVertexCount;
+		simplifyVertexCount[0] += s.simplifyVertexCount[0];
+		simplifyVertexCount[1] += s.simplifyVertexCount[1];
+		simplifySeconds += s.simplifySeconds;
+		return *this;
+	}
+	VertexStatistics & operator-=(const VertexStatistics &s)
+	{
+		arcVertexCount -= s.arcVertexCount;
+		simplifyVertexCount[0] -= s.simplifyVertexCount[0];
+		simplifyVertexCount[1] -= s.simplifyVertexCount[1];
+		simplifySeconds -= s.simplifySeconds;
+		return *this;
+	}
+};
+
+
 /*
  * VertexData set of vertices and handles scan line filling.
  *
@@ -113,15 +203,42 @@ private:
 	std::vector<int> gxIntersects;	// Vector of x coordinates that intersect each edge of polygon on consecutive scan lines
     std::vector<int> linesInCounts;	// For each scan line, linesInCounts holds number of x intersections.
 	Point lastVertex;
-	friend class Polygon;
+	friend class PolygonStore;
+	friend class PolygonReference;
+	friend class ShapeGroup;
+	friend class ApertureCache;
+	friend class GeometryFile;
 	int pixelHeigth;
 	int pixelWidth;
+	void initialiseOutline();
+	void initialiseCapsule();
+	void initialiseSector();
+	void initialiseStroke();
+	void tessellate();
+	void addScanLine( std::vector< std::pair<double,double> > &spans );
 
 public:
+	// OUTLINE is a general polygon with edges joining consecutive vertices.
+	// CAPSULE is the line segment vertices[0] to vertices[1] expanded by radius, i.e. a trace drawn with a round aperture.
+	// SECTOR is the arc about centre vertices[0] starting at vertices[1] and turning by sweep radians, expanded by radius.
+	// STROKE is the polyline through all vertices drawn with the convex pen polygon, or with a round pen of radius when pen is empty.
+	typedef enum {OUTLINE, CAPSULE, SECTOR, STROKE} Shape_t;
+	Shape_t shape;
+	double radius;					// radius of the round ends of a CAPSULE or SECTOR shape, or of a round STROKE pen
+	std::vector<Point> pen;			// vertices of the pen of a STROKE relative to the polyline
+	double sweep;					// angle of a SECTOR arc, 0 to 2*pi
+	bool isClockwise;				// turning direction of a SECTOR arc
 	std::vector<Point> vertices;	// All vertices in polygon
 	double minx, miny, maxx, maxy;
 
+	static double arcTolerance;				// maximum distance in pixels between an arc and its straight line approximation
+	static double simplifyTolerance;		// maximum distance in pixels of removed vertices from a simplified outline, 0 for none
+	static VertexStatistics & statistics();	// work done so far by the calling thread
+
+	VertexData() : shape(OUTLINE), radius(0), sweep(0), isClockwise(false) { }
+
 	bool empty()   	{ return (vertices.size()==0); }
+	void transform( const Transform &m);
 	void scale(double scaleX,  double scaleY );
 	void rotate( double radian);
 	void shift( double x_offset, double y_offset);
@@ -130,43 +247,171 @@ public:
 	void addArc( double start_angle, double end_angle, double radius, double x0=0, double y0=0, bool clockwise=false);
 	void addRegularPolygon( double face_radius, double start_angle, int num_sides, double x0=0, double y0=0);
 	void addRectangle( double x_size, double y_size, double x0=0, double y0=0);
+	void setCapsule( const Point &P1, const Point &P2, double radius);
+	void setSector( double start_angle, double end_angle, double arc_radius, double x0, double y0, bool clockwise, double radius);
+	void setStroke( const std::vector<Point> &polyline, double radius, const std::vector<Point> &pen);
+	void simplify();
 	void initialise();
 };
 
 
 /*
  * The Polygon class.
- * Contains methods to created vertices that make up a general complex polygon.
- * Once vertices are created, the initialise() function is called to create the scan line filling data
+ * A set of vertices placed at an offset and plotted with a polarity. Apertures keep their polygons in this form,
+ * which are copied into a PolygonStore when flashed.
  */
 class Polygon
 {
-private:
+public:
+	VertexData * vdata;
+	Point offset;
+	Polarity_t polarity;							// The plotting polarity
+
+	bool empty()   	{ return vdata->empty(); }
+	Polygon (VertexData *vd) : polarity(DARK) // default to a dark polarity
+				,offset(0,0)
+				,vdata(vd)
+	{ }
+};
+
+
+
+/*
+ * All polygons of an image, stored as a structure of arrays so the rasterizer only touches the fields it needs.
+ * Polygons are appended with push_back() while parsing. Once their vertex data is initialised, initialise(i)
+ * calculates the pixel ranges and sort() puts them in ascending pixelMinY order.
+ */
+class PolygonStore
+{
+public:
+	// Fields used by the rasterizer
+	std::vector<int> pixelMinY, pixelMaxY;
+	std::vector<int> pixelOffsetX;
+	std::vector<VertexData *> vdata;
+	std::vector<unsigned char> polarity;			// Polarity_t
+	std::vector<int> run;							// polarity run, see Gerber constructor. Runs are drawn in ascending order
+
+	// Fields only used while building the image
+	std::vector<Point> offset;
+	std::vector<int> pixelMinX, pixelMaxX;
+
+	size_t size() const	{ return vdata.size(); }
+	bool empty() const	{ return vdata.empty(); }
+	void push_back( VertexData *vd, const Point &offset, Polarity_t polarity);
+	void push_back( const Polygon &p) { push_back(p.vdata, p.offset, p.polarity); }
+	void append( const PolygonStore &rhs, int runOffset = 0);
+	void resize( size_t n);
+	void keep( const std::vector<bool> &isKept);
+	void clear();
+	void initialise( size_t i);
+	void sort();
+};
+
+
+
+/*
+ * The polygons of an aperture, including all apertures of a composite macro, which are drawn together when flashed.
+ * Each polygon has a position relative to the flash point, and a polarity run relative to the first polygon.
+ */
+class ShapeGroup
+{
+public:
+	std::vector<VertexData *> vdata;
+	std::vector<Point> offset;
+	std::vector<unsigned char> polarity;			// Polarity_t
+	std::vector<int> run;
+
+	size_t size() const	{ return vdata.size(); }
+	void push_back( VertexData *vd, Polarity_t polarity);
+	void removeEmpty();
+	int runCount( bool isClear) const { return (isClear || run.empty()) ? 1 : run.back() + 1; }
+	void polygonBounds( size_t j, const Point &flash, int &minx, int &miny, int &maxx, int &maxy) const;
+	void bounds( const Point &flash, int &minx, int &miny, int &maxx, int &maxy) const;
+	bool isAllClear() const;
+};
+
+
+
+/*
+ * Flashes of shape groups, stored like the PolygonStore but with one entry per flash instead of one per polygon.
+ * The polygons of a flash are only created in the rasterizer when the first row of the flash is reached.
+ */
+class FlashStore
+{
+public:
+	std::vector<int> pixelMinY;						// first row of the group, valid after initialise()
+	std::vector<int> group;							// index of the ShapeGroup
+	std::vector<int> run;							// polarity run of the first polygon. Holds the sequence number while parsing
+	std::vector<unsigned char> isClear;				// draw all polygons clear (%LPC)
+	std::vector<Point> offset;
+
+	size_t size() const	{ return group.size(); }
+	bool empty() const	{ return group.empty(); }
+	void push_back( int group, const Point &offset, bool isClear, int sequence);
+	void append( const FlashStore &rhs, int runOffset, int groupOffset);
+	void resize( size_t n);
+	void keep( const std::vector<bool> &isKept);
+	void clear();
+	void initialise( size_t i, const std::vector<ShapeGroup> &groups);
+	void sort();
+};
+
+
+
+/*
+ * The polygons, flashes and shape groups of an image, with the scan tables of their vertex data, kept in a file so
+ * the image can be drawn again without reading the Gerber files. The options the geometry was made with are
+ * stored with it, and load() only accepts a file made with the same options.
+ * The vertex data made by load() holds the bounds and scan tables only, not the vertices.
+ */
+class GeometryFile
+{
+public:
+	enum { FILE_VERSION = 1 };		// changed whenever the file layout changes
+
+	static void save( const char *path, const PolygonStore &polygons, const FlashStore &flashes,
+					  const std::vector<ShapeGroup> &groups, int polarityRunCount, bool isPolarityDark,
+					  const std::vector<double> &options);
+	static void load( const char *path, PolygonStore &polygons, FlashStore &flashes,
+					  std::vector<ShapeGroup> &groups, int &polarityRunCount, bool &isPolarityDark,
+					  const std::vector<double> &options, Arena<VertexData> &vertexArena);
+};
+
+
+
+/*
+ * A polygon in the active list of the rasterizer, holding the position of its next scan line in the vertex data.
+ */
+class PolygonReference
+{
 	int * nextInTable;
 	int * nextInCount;
 
 public:
-	VertexData * vdata;
-	int pixelMinX, pixelMinY, pixelMaxX, pixelMaxY;
+	int pixelMinY;
+	int run;
+	int pixelMaxY;
 	int pixelOffsetX;
-	Point offset;
+	Polarity_t polarity;
 
-	int number;										// used to sort order of creation of polygons
-	Polarity_t polarity;							// The plotting polarity
+	// Reference to polygon i of the store, moved by dx,dy pixels with its polarity run increased by runOffset.
+	PolygonReference( const PolygonStore &store, int i, int dx = 0, int dy = 0, int runOffset = 0) :
+		 nextInTable( &store.vdata[i]->gxIntersects[0] )
+		,nextInCount( &store.vdata[i]->linesInCounts[0] )
+		,pixelMinY( store.pixelMinY[i] + dy )
+		,run( store.run[i] + runOffset )
+		,pixelMaxY( store.pixelMaxY[i] + dy )
+		,pixelOffsetX( store.pixelOffsetX[i] + dx )
+		,polarity( Polarity_t(store.polarity[i]) )
+	{ }
 
-	void initialise();
-	std::vector<int> const & getNextLineX1X2Pairs();
-	bool empty()   	{ return vdata->empty(); }
-	bool operator<(const Polygon &rhs) const
+	// Reference to polygon j of a flashed shape group
+	PolygonReference( const FlashStore &flashes, int i, const ShapeGroup &group, int j, int dx = 0, int dy = 0, int runOffset = 0);
+
+	bool operator<( const PolygonReference &rhs) const
 	{
-		return pixelMinY < rhs.pixelMinY;
+		return run < rhs.run;
 	}
-	Polygon () : polarity(DARK) // default to a dark polarity
-				,offset(0,0)
-				,nextInCount(0)
-				,nextInTable(0)
-				,vdata(new VertexData)
-	{ }
 
 	/*
 	 * Each call will return the polygon edge intercepting data for the next scan line. The first call will be for the first scan line of
@@ -175,13 +420,6 @@ public:
 	 */
 	void getNextLineX1X2Pairs(int * &sliTable, int &sliCount )
 	{
-		 // Resets the scan line counters to zero  on first call to this function
-		if (nextInCount == 0)
-		{
-			nextInCount = &vdata->linesInCounts.front();
-			nextInTable = &vdata->gxIntersects.front();
-		}
-
 		sliCount = *nextInCount;
 		sliTable = nextInTable;
 		nextInTable += sliCount;
@@ -191,16 +429,4 @@ public:
 
 
 
-class PolygonReference
-{
-public:
-	Polygon *polygon;
-	bool operator<( const PolygonReference &rhs) const
-	{
-		return polygon->number < rhs.polygon->number;
-	}
-};
-
-
-
 #endif /*POLYGON_H_*/
@@ -0,0 +1,70 @@
+/*	Mutex and timing helpers for parsing Gerber files on several threads
+
+	copyright (c), 2001 Adam Seychell.
+
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef THREADS_H_
+#define THREADS_H_
+
+#include <pthread.h>
+#include <time.h>
+
+
+class Mutex
+{
+	pthread_mutex_t mutex;
+
+	Mutex(const Mutex &);				// not copyable
+	Mutex & operator=(const Mutex &);
+
+public:
+	Mutex()			{ pthread_mutex_init(&mutex, 0); }
+	~Mutex()		{ pthread_mutex_destroy(&mutex); }
+	void lock()		{ pthread_mutex_lock(&mutex); }
+	void unlock()	{ pthread_mutex_unlock(&mutex); }
+};
+
+
+/*
+ * Holds a mutex for the lifetime of the object, so it is also released when an exception is thrown.
+ */
+class MutexLock
+{
+	Mutex &mutex;
+
+	MutexLock(const MutexLock &);
+	MutexLock & operator=(const MutexLock &);
+
+public:
+	explicit MutexLock(Mutex &m) : mutex(m)	{ mutex.lock(); }
+	~MutexLock()							{ mutex.unlock(); }
+};
+
+
+// Processor time used by the calling thread in seconds. clock() counts all threads of the process.
+inline double threadSeconds()
+{
+	struct timespec t;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0)
+		return double(clock()) / CLOCKS_PER_SEC;
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+
+#endif /*THREADS_H_*/
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Draw each gerber file of the test directory and compare the dark area with the one given by its first line:
+#
+#     G04 check: <gerb2tiff options> -> <dark area in sq.cm>*
+#
+# Each file is drawn twice, so a test with a --cache-dir=check.cache option also checks the image drawn from the
+# aperture scan tables written to the cache by the first run.
+#
+# usage: run.sh <gerb2tiff> <test directory>
+
+gerb2tiff=$1
+dir=$2
+failed=0
+for f in "$dir"/*.gbr
+do
+	check=`sed -n '1s/^G04 check: \(.*\)\*$/\1/p' "$f"`
+	options=`echo "$check" | sed 's/ *->.*//'`
+	expected=`echo "$check" | sed 's/.*-> *//'`
+	rm -rf check.cache
+	area=`$gerb2tiff -q -a $options -o check.tiff "$f" | sed -n 's/^ *dark  area (sq.cm): *//p'`
+	again=`$gerb2tiff -q -a $options -o check.tiff "$f" | sed -n 's/^ *dark  area (sq.cm): *//p'`
+	rm -rf check.tiff check.cache
+	if test -n "$check" && test "$area" = "$expected" && test "$again" = "$expected"
+	then
+		echo "PASS: `basename $f`"
+	else
+		echo "FAIL: `basename $f` dark area $area then $again sq.cm, expected $expected"
+		failed=1
+	fi
+done
+exit $failed